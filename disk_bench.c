@@ -0,0 +1,255 @@
+/* disk_bench.c
+ *
+ * Micro-benchmark for the disk emulator block transfer path.
+ * Build with "make bench" and run ./disk_bench [num_blocks] [iterations].
+ * Set DISK_EMU_BACKEND=mmap to measure the memory-mapped backend.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "disk_emu.h"
+
+#define BENCH_DISK_NAME  "disk_bench_image"
+#define BENCH_BLOCK_SIZE 1024
+/*Sequential write workload: blocks per write_blocks call, blocks between barriers*/
+#define BENCH_WRITE_CHUNK 8
+#define BENCH_BARRIER_INTERVAL 64
+
+static const char *durability_names[] = {"none", "flush", "fdatasync", "dsync"};
+
+/*-------------------------------------*/
+/*Returns a monotonic timestamp in ns  */
+/*-------------------------------------*/
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*-------------------------------------------------------------------*/
+/*Cost of a single block memcpy, to compare read_blocks against     */
+/*-------------------------------------------------------------------*/
+static double bench_memcpy(char *src, char *dst, int num_blocks, int iterations)
+{
+    int i, j;
+    double start = now_ns();
+
+    for (i = 0; i < iterations; i++)
+    {
+        for (j = 0; j < num_blocks; j++)
+        {
+            memcpy(dst + j * BENCH_BLOCK_SIZE, src + j * BENCH_BLOCK_SIZE, BENCH_BLOCK_SIZE);
+        }
+        /*Keep the compiler from dropping the copies*/
+        __asm__ __volatile__("" : : "r"(dst) : "memory");
+    }
+    return (now_ns() - start) / ((double) num_blocks * iterations);
+}
+
+/*---------------------------------------------------------------*/
+/*Baseline: the bare pread the emulator has to do for every block*/
+/*---------------------------------------------------------------*/
+static double bench_raw_read(char *dst, int num_blocks, int iterations)
+{
+    int i, j;
+    int raw = open(BENCH_DISK_NAME, O_RDONLY);
+    double start = now_ns();
+
+    for (i = 0; i < iterations; i++)
+    {
+        for (j = 0; j < num_blocks; j++)
+        {
+            pread(raw, dst + j * BENCH_BLOCK_SIZE, BENCH_BLOCK_SIZE, (off_t) j * BENCH_BLOCK_SIZE);
+        }
+    }
+    start = (now_ns() - start) / ((double) num_blocks * iterations);
+    close(raw);
+    return start;
+}
+
+/*-------------------------------------------------------------*/
+/*Baseline for a mapped image: one copy straight out of the map*/
+/*-------------------------------------------------------------*/
+static double bench_raw_map(char *dst, int num_blocks, int iterations)
+{
+    int i, j;
+    double start = now_ns();
+
+    for (i = 0; i < iterations; i++)
+    {
+        for (j = 0; j < num_blocks; j++)
+        {
+            memcpy(dst + j * BENCH_BLOCK_SIZE, disk_block_ptr(j), BENCH_BLOCK_SIZE);
+        }
+        __asm__ __volatile__("" : : "r"(dst) : "memory");
+    }
+    return (now_ns() - start) / ((double) num_blocks * iterations);
+}
+
+static double bench_read_blocks(char *dst, int num_blocks, int iterations)
+{
+    int i, j;
+    double start = now_ns();
+
+    for (i = 0; i < iterations; i++)
+    {
+        for (j = 0; j < num_blocks; j++)
+        {
+            read_blocks(j, 1, dst + j * BENCH_BLOCK_SIZE);
+        }
+    }
+    return (now_ns() - start) / ((double) num_blocks * iterations);
+}
+
+static double bench_write_blocks(char *src, int num_blocks, int iterations)
+{
+    int i, j;
+    double start = now_ns();
+
+    for (i = 0; i < iterations; i++)
+    {
+        for (j = 0; j < num_blocks; j++)
+        {
+            write_blocks(j, 1, src + j * BENCH_BLOCK_SIZE);
+        }
+    }
+    return (now_ns() - start) / ((double) num_blocks * iterations);
+}
+
+/*------------------------------------------------------------------*/
+/*Prints the counters of one kind of operation and the latency      */
+/*bucket the median call fell in                                    */
+/*------------------------------------------------------------------*/
+static void print_op_stats(const char *name, const struct disk_op_stats *op)
+{
+    unsigned long long seen = 0;
+    int bucket;
+
+    for (bucket = 0; bucket < DISK_LAT_BUCKETS - 1; bucket++)
+    {
+        seen += op->latency_hist[bucket];
+        if (seen * 2 >= op->calls)
+            break;
+    }
+    printf("%-6s calls=%llu blocks=%llu errors=%llu mean=%.1f us median<%d us\n", name,
+           op->calls, op->blocks, op->errors, op->calls ? op->total_ns / 1e3 / op->calls : 0.0,
+           2 << bucket);
+}
+
+/*------------------------------------------------------------------*/
+/*Sequential write throughput in MB/s under a given durability mode */
+/*------------------------------------------------------------------*/
+static double bench_durability(int mode, char *src, int num_blocks, int iterations)
+{
+    int i, j;
+    double start, elapsed;
+
+    disk_set_durability(mode);
+    if (init_fresh_disk(BENCH_DISK_NAME, BENCH_BLOCK_SIZE, num_blocks) == -1)
+        return 0;
+
+    start = now_ns();
+    for (i = 0; i < iterations; i++)
+    {
+        for (j = 0; j + BENCH_WRITE_CHUNK <= num_blocks; j += BENCH_WRITE_CHUNK)
+        {
+            write_blocks(j, BENCH_WRITE_CHUNK, src + j * BENCH_BLOCK_SIZE);
+            if ((j + BENCH_WRITE_CHUNK) % BENCH_BARRIER_INTERVAL == 0)
+                disk_barrier();
+        }
+        disk_barrier();
+    }
+    elapsed = now_ns() - start;
+    close_disk();
+    disk_set_durability(DISK_DURABILITY_NONE);
+
+    return ((double) num_blocks * BENCH_BLOCK_SIZE * iterations) / (elapsed / 1e9) / (1024 * 1024);
+}
+
+/*------------------------------------------------------*/
+/*Time init_fresh_disk takes to format an image, in ms  */
+/*------------------------------------------------------*/
+static double bench_format(int eager, int num_blocks)
+{
+    double start;
+
+    disk_set_eager_zero(eager);
+    start = now_ns();
+    if (init_fresh_disk(BENCH_DISK_NAME, BENCH_BLOCK_SIZE, num_blocks) == -1)
+        return 0;
+    start = (now_ns() - start) / 1e6;
+    close_disk();
+    disk_set_eager_zero(0);
+    return start;
+}
+
+int main(int argc, char **argv)
+{
+    int num_blocks = argc > 1 ? atoi(argv[1]) : 1024;
+    int iterations = argc > 2 ? atoi(argv[2]) : 20;
+    int i, mapped;
+    double t_copy, t_raw, t_read, t_write;
+    struct disk_stats wstats, stats;
+
+    char *src = malloc(num_blocks * BENCH_BLOCK_SIZE);
+    char *dst = malloc(num_blocks * BENCH_BLOCK_SIZE);
+    for (i = 0; i < num_blocks * BENCH_BLOCK_SIZE; i++)
+    {
+        src[i] = (char) (i * 31);
+    }
+
+    if (init_fresh_disk(BENCH_DISK_NAME, BENCH_BLOCK_SIZE, num_blocks) == -1)
+    {
+        return 1;
+    }
+    t_write = bench_write_blocks(src, num_blocks, iterations);
+    disk_get_stats(NULL, &wstats);
+    disk_reset_stats(NULL);
+    t_read = bench_read_blocks(dst, num_blocks, iterations);
+    if (memcmp(src, dst, num_blocks * BENCH_BLOCK_SIZE) != 0)
+    {
+        printf("Error: data read back does not match data written\n");
+        return 1;
+    }
+    mapped = disk_block_ptr(0) != NULL;
+    if (mapped)
+        t_raw = bench_raw_map(dst, num_blocks, iterations);
+    else
+        t_raw = bench_raw_read(dst, num_blocks, iterations);
+    t_copy = bench_memcpy(src, dst, num_blocks, iterations);
+    disk_get_stats(NULL, &stats);
+    close_disk();
+
+    printf("blocks=%d block_size=%d iterations=%d backend=%s\n", num_blocks, BENCH_BLOCK_SIZE, iterations,
+           mapped ? "mmap" : "pread");
+    printf("write_blocks        %10.1f ns/block\n", t_write);
+    printf("read_blocks         %10.1f ns/block\n", t_read);
+    printf("raw %s baseline  %10.1f ns/block\n", mapped ? "mmap " : "pread", t_raw);
+    printf("1 block memcpy      %10.1f ns/block\n", t_copy);
+    /*Copies of the data per block asked for, 1.00x when nothing is staged on the way*/
+    printf("bytes copied/block  write %.2fx read %.2fx\n",
+           (double) wstats.bytes_copied / ((double) num_blocks * iterations * BENCH_BLOCK_SIZE),
+           (double) stats.bytes_copied / ((double) num_blocks * iterations * BENCH_BLOCK_SIZE));
+    print_op_stats("read", &stats.read);
+    print_op_stats("write", &wstats.write);
+    printf("seeks  %llu\n", wstats.seeks + stats.seeks);
+
+    printf("sequential writes, %d blocks per call, barrier every %d blocks\n",
+           BENCH_WRITE_CHUNK, BENCH_BARRIER_INTERVAL);
+    for (i = DISK_DURABILITY_NONE; i <= DISK_DURABILITY_DSYNC; i++)
+    {
+        printf("durability %-9s %10.1f MB/s\n", durability_names[i],
+               bench_durability(i, src, num_blocks, iterations));
+    }
+
+    printf("format %d blocks sparse %10.3f ms\n", num_blocks, bench_format(0, num_blocks));
+    printf("format %d blocks eager  %10.3f ms\n", num_blocks, bench_format(1, num_blocks));
+
+    free(src);
+    free(dst);
+    return 0;
+}
@@ -1,93 +1,1818 @@
+#define _GNU_SOURCE
+/*Byte offsets into the image are 64-bit on every platform, images can be larger than 2 GiB*/
+#define _FILE_OFFSET_BITS 64
 #include <stdio.h>
 #include <stdlib.h> 
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+/*Pulled in by the kernel headers, clashes with the disk geometry below*/
+#undef BLOCK_SIZE
+#endif
 #include "disk_emu.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
-FILE* fp = NULL;
-double L, p;
-double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY, lru;
+struct stripe_job;
+
+/*One backing file of a disk, with the thread serving it when striped*/
+struct disk_member {
+    struct disk *disk;
+    FILE* fp;
+    int fd;
+    pthread_t thread;
+    /*Parts of runs waiting for the thread*/
+    struct stripe_job *queue;
+    pthread_cond_t work;
+};
+
+/*An open disk. Everything a transfer needs lives here, so disks opened*/
+/*with disk_open can be used from different threads at the same time   */
+struct disk {
+    /*Backing files, a striped (RAID-0) disk has one per member*/
+    struct disk_member member[DISK_MAX_STRIPES];
+    int nmembers;
+    /*Descriptor of member 0, all block transfers use positional I/O on it*/
+    int fd;
+    /*Blocks per stripe unit when striped*/
+    int STRIPE_UNIT;
+    /*Whole image mapping when the mmap backend is in use, NULL otherwise*/
+    char* map;
+    size_t map_len;
+    /*What disk_sync does to make writes durable, see disk_set_durability*/
+    int durability;
+    int BLOCK_SIZE, MAX_BLOCK;
+
+    /*Device model, see disk_set_model: L is the base latency of a request in us,*/
+    /*p the probability that a transfer fails and has to be retried              */
+    double L, p;
+    /*Seek cost in us per block of distance, bandwidth in MB/s (0 = unlimited)*/
+    double SEEK_COST, BANDWIDTH;
+    /*Requests the device services at the same time*/
+    int QUEUE_DEPTH;
+    int MAX_RETRY;
+    /*Block following the last request serviced, i.e. where the head is*/
+    int head_position;
+    int model_busy;
+    /*State of the failure draws, private so disks do not share rand()*/
+    unsigned int seed;
+    pthread_mutex_t model_lock;
+    pthread_cond_t model_free;
+
+    /*Member threads, owned by the process that started them*/
+    pid_t stripe_pid;
+    int stripe_nthreads;
+    int stripe_stopping;
+    pthread_mutex_t stripe_lock;
+    pthread_cond_t stripe_done;
+
+    /*Buffer cache, see disk_set_cache. NULL when the disk has none*/
+    struct cache_entry *cache;
+    char *cache_data;
+    int cache_capacity;
+    int cache_policy;
+    /*Entries handed out so far, the rest are still free*/
+    int cache_used;
+    /*Block number -> entry chains*/
+    int *cache_hash;
+    int cache_hash_mask;
+    /*CLOCK hand, LRU list from most to least recently used*/
+    int cache_hand;
+    int lru_head, lru_tail;
+    int cache_dirty;
+    pthread_mutex_t cache_lock;
+
+    /*I/O statistics, see disk_get_stats*/
+    struct disk_stats stats;
+    /*Block following the last transfer, a transfer starting elsewhere is a seek*/
+    int next_address;
+    pthread_mutex_t stats_lock;
+
+    /*Next disk on the list of open disks, see fork_prepare*/
+    struct disk *next_open;
+};
+
+/*Disk behind init_disk/init_fresh_disk and the functions without a handle*/
+static disk_t *default_disk = NULL;
+
+/*Settings applied to the disks opened from now on*/
+/*Striping asked for by disk_set_striping or the environment*/
+static int striping_explicit = 0;
+static int striping_members = 1;
+static int striping_unit = 16;
+/*Allocate and zero new images up front instead of leaving them sparse*/
+static int eager_zero = 0;
+static int eager_zero_explicit = 0;
+/*Bytes written per call when zeros have to be written out*/
+#define ZERO_CHUNK (1 << 20)
+/*Durability mode, see disk_set_durability*/
+static int durability = DISK_DURABILITY_NONE;
+/*Buffer cache asked for by disk_set_cache or the environment*/
+static int cache_explicit = 0;
+static int cache_blocks = 0;
+static int cache_policy = DISK_CACHE_CLOCK;
+/*Device model chosen by disk_set_model, the environment is then ignored*/
+static struct disk_model explicit_model;
+static int model_explicit = 0;
+static pthread_mutex_t explicit_model_lock = PTHREAD_MUTEX_INITIALIZER;
+/*Every open disk, whose locks fork takes, see fork_prepare*/
+static disk_t *open_disks = NULL;
+static pthread_mutex_t open_disks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t fork_once = PTHREAD_ONCE_INIT;
+
+static void async_drain();
+static void fork_install();
+static void stripe_stop(disk_t *disk);
+static void cache_setup(disk_t *disk);
+static void cache_free(disk_t *disk);
+
+/*----------------------------------------------------------*/
+/*Closes a disk opened with disk_open and frees its handle   */
+/*----------------------------------------------------------*/
+int disk_close(disk_t *disk)
+{
+    disk_t **link;
+    int i;
+
+    if (disk == NULL)
+        return -1;
+
+    /*Dirty cached blocks go out before the files are closed*/
+    disk_flush(disk);
+    cache_free(disk);
+    if(NULL != disk->map)
+    {
+        disk_sync(disk);
+        munmap(disk->map, disk->map_len);
+        disk->map = NULL;
+        disk->map_len = 0;
+    }
+    stripe_stop(disk);
+    for (i = 0; i < disk->nmembers; i++)
+    {
+        if(NULL != disk->member[i].fp)
+            fclose(disk->member[i].fp);
+        pthread_cond_destroy(&disk->member[i].work);
+    }
+    pthread_mutex_lock(&open_disks_lock);
+    for (link = &open_disks; *link != disk; link = &(*link)->next_open)
+        ;
+    *link = disk->next_open;
+    pthread_mutex_unlock(&open_disks_lock);
+    pthread_mutex_destroy(&disk->model_lock);
+    pthread_cond_destroy(&disk->model_free);
+    pthread_mutex_destroy(&disk->stripe_lock);
+    pthread_cond_destroy(&disk->stripe_done);
+    pthread_mutex_destroy(&disk->stats_lock);
+    pthread_mutex_destroy(&disk->cache_lock);
+    free(disk);
+    return 0;
+}
 
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
 /*----------------------------------------------------------*/
 int close_disk()
 {
-    if(NULL != fp)
+    disk_t *disk = default_disk;
+
+    if (disk == NULL)
+        return 0;
+
+    /*Requests still in flight need the descriptor*/
+    async_drain();
+    default_disk = NULL;
+    return disk_close(disk);
+}
+
+/*------------------------------------------------------------------*/
+/*Tells whether the mmap backend was asked for, by the caller or via */
+/*the DISK_EMU_BACKEND=mmap environment variable                     */
+/*------------------------------------------------------------------*/
+static int use_mmap_backend(disk_t *disk, int flags)
+{
+    char *backend = getenv("DISK_EMU_BACKEND");
+
+    if (!(flags & DISK_OPEN_MMAP) && (backend == NULL || strcmp(backend, "mmap") != 0))
+        return 0;
+    if (disk->nmembers > 1)
+    {
+        printf("Striped disks cannot be mapped, using positional I/O\n");
+        return 0;
+    }
+    return 1;
+}
+
+/*------------------------------------------------------------------*/
+/*Maps the whole opened image so blocks are served as memory copies */
+/*Falls back to positional I/O if the image cannot be mapped        */
+/*------------------------------------------------------------------*/
+static int map_disk(disk_t *disk)
+{
+    struct stat st;
+    void *addr;
+
+    disk->map_len = (size_t) disk->MAX_BLOCK * disk->BLOCK_SIZE;
+    if (fstat(disk->fd, &st) == -1 || (size_t) st.st_size < disk->map_len)
+    {
+        printf("Could not map disk: image is smaller than %d blocks\n", disk->MAX_BLOCK);
+        disk->map_len = 0;
+        return 0;
+    }
+
+    addr = mmap(NULL, disk->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+    if (addr == MAP_FAILED)
+    {
+        printf("Could not map disk, using positional I/O\n");
+        disk->map_len = 0;
+        return 0;
+    }
+    disk->map = (char*) addr;
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Opens the image file, synchronously when durability is O_DSYNC    */
+/*------------------------------------------------------------------*/
+static FILE* open_image(disk_t *disk, char *filename, int flags, const char *mode)
+{
+    int image_fd;
+    FILE *image;
+
+    flags |= O_RDWR;
+    if (disk->durability == DISK_DURABILITY_DSYNC)
+        flags |= O_DSYNC;
+
+    image_fd = open(filename, flags, 0644);
+    if (image_fd == -1)
+        return NULL;
+    image = fdopen(image_fd, mode);
+    if (image == NULL)
+        close(image_fd);
+    return image;
+}
+
+/*--------------------------------------------------------------*/
+/*Installs a device model (a NULL model disables every cost)    */
+/*--------------------------------------------------------------*/
+static void apply_model(disk_t *disk, const struct disk_model *model)
+{
+    disk->L = model ? model->latency_us : 0;
+    disk->SEEK_COST = model ? model->seek_us_per_block : 0;
+    disk->BANDWIDTH = model ? model->bandwidth_mbps : 0;
+    disk->QUEUE_DEPTH = model && model->queue_depth > 0 ? model->queue_depth : 1;
+    disk->p = model && model->failure_p > 0 ? model->failure_p : -1.f;
+    disk->MAX_RETRY = model && model->max_retry >= 0 ? model->max_retry : 3;
+    disk->head_position = 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Fills a model from a preset name: "none", "hdd" or "ssd"          */
+/*------------------------------------------------------------------*/
+int disk_model_preset(const char *name, struct disk_model *model)
+{
+    memset(model, 0, sizeof(*model));
+    model->queue_depth = 1;
+    model->max_retry = 3;
+
+    if (name == NULL || strcmp(name, "none") == 0)
+        return 0;
+    if (strcmp(name, "hdd") == 0)
+    {
+        /*Rotation plus controller overhead, ~5 ms for a full stroke of the default image*/
+        model->latency_us = 2000;
+        model->seek_us_per_block = 5;
+        model->bandwidth_mbps = 150;
+        model->queue_depth = 1;
+        return 0;
+    }
+    if (strcmp(name, "ssd") == 0)
+    {
+        model->latency_us = 80;
+        model->bandwidth_mbps = 500;
+        model->queue_depth = 32;
+        return 0;
+    }
+    printf("Unknown disk model %s\n", name);
+    return -1;
+}
+
+/*------------------------------------------------------------------*/
+/*Selects the device model, overriding the environment. Applies to  */
+/*the default disk right away and to every disk opened afterwards   */
+/*------------------------------------------------------------------*/
+int disk_set_model(const struct disk_model *model)
+{
+    pthread_mutex_lock(&explicit_model_lock);
+    if (model == NULL)
+        disk_model_preset(NULL, &explicit_model);
+    else
+        explicit_model = *model;
+    model_explicit = 1;
+    /*Transfers may be running on the default disk*/
+    if (default_disk != NULL)
+    {
+        pthread_mutex_lock(&default_disk->model_lock);
+        apply_model(default_disk, &explicit_model);
+        pthread_mutex_unlock(&default_disk->model_lock);
+    }
+    pthread_mutex_unlock(&explicit_model_lock);
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Reads the device model from the environment unless disk_set_model */
+/*chose one: DISK_EMU_MODEL=none|hdd|ssd picks a preset, then       */
+/*DISK_EMU_LATENCY_US, DISK_EMU_SEEK_US, DISK_EMU_BANDWIDTH_MBPS,   */
+/*DISK_EMU_QUEUE_DEPTH, DISK_EMU_FAILURE_P and DISK_EMU_MAX_RETRY   */
+/*override single parameters                                        */
+/*------------------------------------------------------------------*/
+static void load_model(disk_t *disk)
+{
+    struct disk_model model;
+    char *value;
+
+    pthread_mutex_lock(&explicit_model_lock);
+    if (model_explicit)
+    {
+        apply_model(disk, &explicit_model);
+        pthread_mutex_unlock(&explicit_model_lock);
+        return;
+    }
+    pthread_mutex_unlock(&explicit_model_lock);
+
+    if (disk_model_preset(getenv("DISK_EMU_MODEL"), &model) == -1)
+        disk_model_preset(NULL, &model);
+
+    if ((value = getenv("DISK_EMU_LATENCY_US")) != NULL)
+        model.latency_us = atof(value);
+    if ((value = getenv("DISK_EMU_SEEK_US")) != NULL)
+        model.seek_us_per_block = atof(value);
+    if ((value = getenv("DISK_EMU_BANDWIDTH_MBPS")) != NULL)
+        model.bandwidth_mbps = atof(value);
+    if ((value = getenv("DISK_EMU_QUEUE_DEPTH")) != NULL)
+        model.queue_depth = atoi(value);
+    if ((value = getenv("DISK_EMU_FAILURE_P")) != NULL)
+        model.failure_p = atof(value);
+    if ((value = getenv("DISK_EMU_MAX_RETRY")) != NULL)
+        model.max_retry = atoi(value);
+
+    apply_model(disk, &model);
+}
+
+/*------------------------------------------------------------------*/
+/*Tells whether the device model charges anything at all (locked)   */
+/*------------------------------------------------------------------*/
+static int model_charges(disk_t *disk)
+{
+    return disk->L > 0 || disk->SEEK_COST > 0 || disk->BANDWIDTH > 0 || disk->p > 0;
+}
+
+static int model_active(disk_t *disk)
+{
+    int active;
+
+    pthread_mutex_lock(&disk->model_lock);
+    active = model_charges(disk);
+    pthread_mutex_unlock(&disk->model_lock);
+    return active;
+}
+
+/*------------------------------------------------------------------*/
+/*Services one request of nblocks contiguous blocks on the modeled  */
+/*device: waits for a free queue slot, then for the base latency,   */
+/*the seek from the previous request and the transfer time. A       */
+/*failed attempt is retried up to MAX_RETRY times.                  */
+/*Returns 0 if the transfer may proceed, -1 if it failed for good   */
+/*------------------------------------------------------------------*/
+static int device_service(disk_t *disk, int start_address, int nblocks)
+{
+    double delay, r, p;
+    int attempt, failed, max_retry;
+
+    /*disk_set_model may change the model meanwhile, this request keeps the one it started with*/
+    pthread_mutex_lock(&disk->model_lock);
+    if (!model_charges(disk))
+    {
+        pthread_mutex_unlock(&disk->model_lock);
+        return 0;
+    }
+    while (disk->model_busy >= disk->QUEUE_DEPTH)
+        pthread_cond_wait(&disk->model_free, &disk->model_lock);
+    disk->model_busy++;
+    delay = disk->L + disk->SEEK_COST * abs(start_address - disk->head_position);
+    if (disk->BANDWIDTH > 0)
+        delay += (double) nblocks * disk->BLOCK_SIZE / (disk->BANDWIDTH * 1024 * 1024) * 1e6;
+    p = disk->p;
+    max_retry = disk->MAX_RETRY;
+    disk->head_position = start_address + nblocks;
+    pthread_mutex_unlock(&disk->model_lock);
+
+    failed = 0;
+    for (attempt = 0; ; attempt++)
+    {
+        /*Pause until the latency duration is elapsed*/
+        if (delay >= 1)
+            usleep(delay);
+
+        pthread_mutex_lock(&disk->model_lock);
+        r = (double) rand_r(&disk->seed) / RAND_MAX;
+        pthread_mutex_unlock(&disk->model_lock);
+        if (p <= 0 || r >= p)
+            break;
+        if (attempt == max_retry)
+        {
+            failed = -1;
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&disk->model_lock);
+    disk->model_busy--;
+    pthread_cond_signal(&disk->model_free);
+    pthread_mutex_unlock(&disk->model_lock);
+    return failed;
+}
+
+/*------------------------------------------------------------------*/
+/*Stripes the disk over members image files, stripe_unit blocks at a*/
+/*time, from the next init on. One member turns striping off. The   */
+/*members are <filename>.0 to <filename>.<members-1>, and an        */
+/*existing disk must be opened with the striping it was created with*/
+/*------------------------------------------------------------------*/
+int disk_set_striping(int members, int stripe_unit)
+{
+    if (members < 1 || members > DISK_MAX_STRIPES || stripe_unit < 1)
+    {
+        printf("Invalid striping %d x %d blocks\n", members, stripe_unit);
+        return -1;
+    }
+    striping_explicit = 1;
+    striping_members = members;
+    striping_unit = stripe_unit;
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Applies the striping, from DISK_EMU_STRIPES/DISK_EMU_STRIPE_UNIT  */
+/*unless disk_set_striping chose one                                */
+/*------------------------------------------------------------------*/
+static void load_striping(disk_t *disk)
+{
+    char *value;
+    int members = striping_members;
+    int unit = striping_unit;
+
+    if (!striping_explicit)
+    {
+        members = 1;
+        unit = 16;
+        if ((value = getenv("DISK_EMU_STRIPES")) != NULL)
+            members = atoi(value);
+        if ((value = getenv("DISK_EMU_STRIPE_UNIT")) != NULL)
+            unit = atoi(value);
+        if (members < 1 || members > DISK_MAX_STRIPES)
+            members = 1;
+        if (unit < 1)
+            unit = 16;
+    }
+    disk->nmembers = members;
+    disk->STRIPE_UNIT = unit;
+}
+
+/*------------------------------------------------------------------*/
+/*New images are sparse unless eager zeroing is asked for, see      */
+/*disk_set_eager_zero                                               */
+/*------------------------------------------------------------------*/
+int disk_set_eager_zero(int eager)
+{
+    eager_zero = eager ? 1 : 0;
+    eager_zero_explicit = 1;
+    return 0;
+}
+
+static int use_eager_zero()
+{
+    char *value = getenv("DISK_EMU_EAGER_ZERO");
+
+    if (eager_zero_explicit)
+        return eager_zero;
+    return value != NULL && atoi(value) != 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Sizes a new (empty) image file to nblocks blocks of 0's. By default*/
+/*the file is only extended, which leaves it sparse and costs one   */
+/*call whatever its size. Eager zeroing allocates the space up front*/
+/*so first writes do not pay for it, writing the zeros out in big   */
+/*chunks only when the file system cannot allocate them itself.     */
+/*------------------------------------------------------------------*/
+static int fill_zeros(int image, off_t size)
+{
+    off_t offset;
+    ssize_t done;
+    char *zeros;
+
+    if (!use_eager_zero())
+        return ftruncate(image, size);
+
+    if (posix_fallocate(image, 0, size) == 0)
+        return 0;
+
+    zeros = (char*) calloc(ZERO_CHUNK, 1);
+    if (zeros == NULL)
+        return -1;
+    for (offset = 0; offset < size; offset += done)
+    {
+        done = pwrite(image, zeros, size - offset < ZERO_CHUNK ? size - offset : ZERO_CHUNK, offset);
+        if (done <= 0)
+        {
+            if (done == -1 && errno == EINTR)
+            {
+                done = 0;
+                continue;
+            }
+            free(zeros);
+            return -1;
+        }
+    }
+    free(zeros);
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Opens (or creates, when fresh) the backing file(s) of the disk    */
+/*------------------------------------------------------------------*/
+static int open_members(disk_t *disk, char *filename, int fresh)
+{
+    char member_name[4096];
+    int flags = fresh ? O_CREAT | O_TRUNC : 0;
+    const char *mode = fresh ? "w+b" : "r+b";
+    int nmembers = disk->nmembers;
+    /*Every member holds the same number of whole stripe units*/
+    int stripes = disk->MAX_BLOCK / disk->STRIPE_UNIT + (disk->MAX_BLOCK % disk->STRIPE_UNIT != 0);
+    int member_blocks = (stripes + nmembers - 1) / nmembers * disk->STRIPE_UNIT;
+    int i;
+
+    for (i = 0; i < nmembers; i++)
+    {
+        struct disk_member *member = &disk->member[i];
+
+        if (nmembers == 1)
+            snprintf(member_name, sizeof(member_name), "%s", filename);
+        else
+            snprintf(member_name, sizeof(member_name), "%s.%d", filename, i);
+
+        member->fp = open_image(disk, member_name, flags, mode);
+        if (member->fp == NULL)
+        {
+            if (fresh)
+                printf("Could not create new disk file %s\n\n", member_name);
+            else
+                printf("Could not open %s\n\n", member_name);
+            return -1;
+        }
+        member->fd = fileno(member->fp);
+        if (fresh && fill_zeros(member->fd,
+                                (off_t) (nmembers == 1 ? disk->MAX_BLOCK : member_blocks) * disk->BLOCK_SIZE) == -1)
+        {
+            printf("Could not size new disk file %s\n\n", member_name);
+            return -1;
+        }
+    }
+    disk->fd = disk->member[0].fd;
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Opens a disk of num_blocks blocks of block_size bytes and returns */
+/*its handle, NULL on failure. DISK_OPEN_FRESH creates a new image  */
+/*filled with 0's, DISK_OPEN_MMAP serves it from a mapping. Each    */
+/*handle has its own state and locks: several disks may be open at  */
+/*once, and several threads may transfer on the same disk together, */
+/*as the async workers and the member threads of a striped disk do  */
+/*------------------------------------------------------------------*/
+disk_t *disk_open(char *filename, int block_size, int num_blocks, int flags)
+{
+    disk_t *disk;
+    int i;
+
+    if (block_size <= 0 || num_blocks <= 0)
+    {
+        printf("Invalid disk geometry %d x %d\n", num_blocks, block_size);
+        return NULL;
+    }
+
+    disk = (disk_t*) calloc(1, sizeof(disk_t));
+    if (disk == NULL)
+        return NULL;
+    disk->BLOCK_SIZE = block_size;
+    disk->MAX_BLOCK = num_blocks;
+    disk->fd = -1;
+    disk->durability = durability;
+    disk->seed = (unsigned int) time(0) ^ (unsigned int) (size_t) disk;
+    pthread_mutex_init(&disk->model_lock, NULL);
+    pthread_cond_init(&disk->model_free, NULL);
+    pthread_mutex_init(&disk->stripe_lock, NULL);
+    pthread_cond_init(&disk->stripe_done, NULL);
+    pthread_mutex_init(&disk->stats_lock, NULL);
+    pthread_mutex_init(&disk->cache_lock, NULL);
+
+    /*Set up latency, failure rate and retries from the device model*/
+    load_model(disk);
+    load_striping(disk);
+    for (i = 0; i < disk->nmembers; i++)
+    {
+        disk->member[i].disk = disk;
+        disk->member[i].fd = -1;
+        pthread_cond_init(&disk->member[i].work, NULL);
+    }
+    pthread_once(&fork_once, fork_install);
+    pthread_mutex_lock(&open_disks_lock);
+    disk->next_open = open_disks;
+    open_disks = disk;
+    pthread_mutex_unlock(&open_disks_lock);
+
+    if (open_members(disk, filename, flags & DISK_OPEN_FRESH) == -1)
+    {
+        disk_close(disk);
+        return NULL;
+    }
+
+    if (use_mmap_backend(disk, flags))
+        map_disk(disk);
+    cache_setup(disk);
+    return disk;
+}
+
+/*------------------------------------------------------------------*/
+/*(Re)opens the default disk used by the functions without a handle */
+/*------------------------------------------------------------------*/
+static int open_default(char *filename, int block_size, int num_blocks, int flags)
+{
+    /*Initializes the random number generator*/
+    srand((unsigned int)(time( 0 )) );
+
+    /*Release a disk left open by a previous init*/
+    close_disk();
+
+    default_disk = disk_open(filename, block_size, num_blocks, flags);
+    return default_disk == NULL ? -1 : 0;
+}
+
+/*---------------------------------------*/
+/*Initializes a disk file filled with 0's*/
+/*---------------------------------------*/
+int init_fresh_disk(char *filename, int block_size, int num_blocks)
+{
+    return open_default(filename, block_size, num_blocks, DISK_OPEN_FRESH);
+}
+/*----------------------------*/
+/*Initializes an existing disk*/
+/*----------------------------*/
+int init_disk(char *filename, int block_size, int num_blocks)
+{
+    return open_default(filename, block_size, num_blocks, 0);
+}
+
+/*----------------------------------------------------------------*/
+/*Same as init_fresh_disk/init_disk but serves blocks from a      */
+/*mapping of the whole image instead of one syscall per transfer  */
+/*----------------------------------------------------------------*/
+int init_fresh_disk_mmap(char *filename, int block_size, int num_blocks)
+{
+    return open_default(filename, block_size, num_blocks, DISK_OPEN_FRESH | DISK_OPEN_MMAP);
+}
+
+int init_disk_mmap(char *filename, int block_size, int num_blocks)
+{
+    return open_default(filename, block_size, num_blocks, DISK_OPEN_MMAP);
+}
+
+/*------------------------------------------------------------------*/
+/*Returns the in-memory address of a block when the image is mapped,*/
+/*NULL otherwise. Writes through it reach the disk at disk_barrier  */
+/*------------------------------------------------------------------*/
+void *disk_block_ptr(int address)
+{
+    disk_t *disk = default_disk;
+
+    if (disk == NULL || disk->map == NULL || address < 0 || address >= disk->MAX_BLOCK)
+        return NULL;
+    return disk->map + (size_t) address * disk->BLOCK_SIZE;
+}
+
+/*------------------------------------------------------------------*/
+/*Returns a monotonic timestamp in ns                               */
+/*------------------------------------------------------------------*/
+static unsigned long long clock_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*------------------------------------------------------------------*/
+/*Counts a transfer starting at start_address as a seek unless it   */
+/*continues the previous one                                        */
+/*------------------------------------------------------------------*/
+static void stats_position(disk_t *disk, int start_address, int nblocks)
+{
+    pthread_mutex_lock(&disk->stats_lock);
+    if (start_address != disk->next_address)
+        disk->stats.seeks++;
+    disk->next_address = start_address + nblocks;
+    pthread_mutex_unlock(&disk->stats_lock);
+}
+
+/*------------------------------------------------------------------*/
+/*Adds to the buffer cache counters                                 */
+/*------------------------------------------------------------------*/
+static void stats_cache(disk_t *disk, int hits, int misses, int writebacks)
+{
+    pthread_mutex_lock(&disk->stats_lock);
+    disk->stats.cache_hits += hits;
+    disk->stats.cache_misses += misses;
+    disk->stats.cache_writebacks += writebacks;
+    pthread_mutex_unlock(&disk->stats_lock);
+}
+
+/*------------------------------------------------------------------*/
+/*Adds blocks of data copied on their way to or from the caller     */
+/*------------------------------------------------------------------*/
+static void stats_copied(disk_t *disk, int nblocks)
+{
+    pthread_mutex_lock(&disk->stats_lock);
+    disk->stats.bytes_copied += (unsigned long long) nblocks * disk->BLOCK_SIZE;
+    pthread_mutex_unlock(&disk->stats_lock);
+}
+
+/*------------------------------------------------------------------*/
+/*Records one finished operation: result is the blocks transferred, */
+/*or minus the blocks that failed, and start when it began          */
+/*------------------------------------------------------------------*/
+static void stats_account(disk_t *disk, struct disk_op_stats *op, int result, unsigned long long start)
+{
+    unsigned long long ns = clock_ns() - start;
+    unsigned long long us = ns / 1000;
+    int bucket = 0;
+
+    while (us > 1 && bucket < DISK_LAT_BUCKETS - 1)
+    {
+        us >>= 1;
+        bucket++;
+    }
+
+    pthread_mutex_lock(&disk->stats_lock);
+    op->calls++;
+    if (result < 0)
+        op->errors++;
+    else
+        op->blocks += result;
+    op->total_ns += ns;
+    op->latency_hist[bucket]++;
+    pthread_mutex_unlock(&disk->stats_lock);
+}
+
+/*------------------------------------------------------------------*/
+/*Copies the statistics of a disk (NULL for the default disk)       */
+/*------------------------------------------------------------------*/
+int disk_get_stats(disk_t *disk, struct disk_stats *stats)
+{
+    if (disk == NULL)
+        disk = default_disk;
+    if (disk == NULL)
+    {
+        memset(stats, 0, sizeof(*stats));
+        return -1;
+    }
+    pthread_mutex_lock(&disk->stats_lock);
+    *stats = disk->stats;
+    pthread_mutex_unlock(&disk->stats_lock);
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Clears the statistics of a disk (NULL for the default disk)       */
+/*------------------------------------------------------------------*/
+int disk_reset_stats(disk_t *disk)
+{
+    if (disk == NULL)
+        disk = default_disk;
+    if (disk == NULL)
+        return -1;
+    pthread_mutex_lock(&disk->stats_lock);
+    memset(&disk->stats, 0, sizeof(disk->stats));
+    pthread_mutex_unlock(&disk->stats_lock);
+    return 0;
+}
+
+/*--------------------------------------------------------------------*/
+/*Selects how disk_barrier makes writes durable. Takes effect at the  */
+/*next init_disk/init_fresh_disk since O_DSYNC is an open-time flag   */
+/*--------------------------------------------------------------------*/
+int disk_set_durability(int mode)
+{
+    if (mode < DISK_DURABILITY_NONE || mode > DISK_DURABILITY_DSYNC)
+    {
+        printf("Unknown durability mode %d\n", mode);
+        return -1;
+    }
+    durability = mode;
+    return 0;
+}
+
+/*-----------------------------------------------------------------*/
+/*Orders everything written so far before what is written next.    */
+/*Writes are never flushed individually, only here, as the         */
+/*durability mode asks:                                            */
+/*  NONE      nothing, data stays with the OS                      */
+/*  FLUSH     start write-back of dirty data, without waiting      */
+/*  FDATASYNC wait until the data is on stable storage             */
+/*  DSYNC     every pwrite was already synchronous; a mapping still*/
+/*            has to be msync'ed                                    */
+/*-----------------------------------------------------------------*/
+static int sync_members(disk_t *disk)
+{
+    int i, ret = 0;
+
+    switch (disk->durability)
+    {
+    case DISK_DURABILITY_FLUSH:
+        if (disk->map != NULL)
+            return msync(disk->map, disk->map_len, MS_ASYNC);
+#ifdef SYNC_FILE_RANGE_WRITE
+        for (i = 0; i < disk->nmembers; i++)
+        {
+            if (sync_file_range(disk->member[i].fd, 0, 0, SYNC_FILE_RANGE_WRITE) == -1)
+                ret = -1;
+        }
+#endif
+        return ret;
+    case DISK_DURABILITY_FDATASYNC:
+        if (disk->map != NULL)
+            return msync(disk->map, disk->map_len, MS_SYNC);
+        for (i = 0; i < disk->nmembers; i++)
+        {
+            if (fdatasync(disk->member[i].fd) == -1)
+                ret = -1;
+        }
+        return ret;
+    case DISK_DURABILITY_DSYNC:
+        if (disk->map != NULL)
+            return msync(disk->map, disk->map_len, MS_SYNC);
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+/*-----------------------------------------------------------------*/
+/*Barrier on one disk, counted in its flush statistics. Dirty      */
+/*blocks of the buffer cache are written back here                 */
+/*-----------------------------------------------------------------*/
+int disk_sync(disk_t *disk)
+{
+    unsigned long long start = clock_ns();
+    int ret;
+
+    if (disk == NULL || disk->fd == -1)
+        return -1;
+
+    /*Cached writes are written back first, the sync then covers them*/
+    ret = disk_flush(disk);
+    if (sync_members(disk) == -1)
+        ret = -1;
+    stats_account(disk, &disk->stats.flush, ret == -1 ? -1 : 0, start);
+    return ret;
+}
+
+/*-----------------------------------------------------------------*/
+/*disk_sync on the default disk                                    */
+/*-----------------------------------------------------------------*/
+int disk_barrier()
+{
+    return disk_sync(default_disk);
+}
+
+/*-------------------------------------------------------------------*/
+/*Checks that every range of a vector lies within the disk            */
+/*-------------------------------------------------------------------*/
+static int check_blk_iovec(disk_t *disk, const struct blk_iovec *iov, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        /*Compared without adding them, the sum of two large ints overflows*/
+        if (iov[i].nblocks < 0 || iov[i].start_address < 0 ||
+            iov[i].nblocks > disk->MAX_BLOCK - iov[i].start_address)
+        {
+            printf("out of bound error %d\n", iov[i].start_address);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/*Transfers one run of contiguous blocks with a single preadv/pwritev */
+/*Retries on short transfers until the whole run has moved            */
+/*-------------------------------------------------------------------*/
+static int transfer_run(int disk_fd, struct iovec *vec, int cnt, off_t offset, int write)
+{
+    ssize_t done;
+
+    while (cnt > 0)
+    {
+        /*A single buffer does not need the vectored call*/
+        if (cnt == 1)
+            done = write ? pwrite(disk_fd, vec->iov_base, vec->iov_len, offset)
+                         : pread(disk_fd, vec->iov_base, vec->iov_len, offset);
+        else if (write)
+            done = pwritev(disk_fd, vec, cnt < IOV_MAX ? cnt : IOV_MAX, offset);
+        else
+            done = preadv(disk_fd, vec, cnt < IOV_MAX ? cnt : IOV_MAX, offset);
+
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return -1;
+
+        offset += done;
+        /*Skip the iovecs that were fully transferred, trim the partial one*/
+        while (cnt > 0 && (size_t) done >= vec->iov_len)
+        {
+            done -= vec->iov_len;
+            vec++;
+            cnt--;
+        }
+        if (cnt > 0)
+        {
+            vec->iov_base = (char*) vec->iov_base + done;
+            vec->iov_len -= done;
+        }
+    }
+    return 0;
+}
+
+/*==================================================================*/
+/*RAID-0 striping                                                   */
+/*                                                                  */
+/*Logical block b lives in stripe unit b/STRIPE_UNIT, which is on   */
+/*member (b/STRIPE_UNIT) % nmembers. The part of a contiguous run   */
+/*that falls on one member is contiguous in that member's file, so  */
+/*a run costs at most one preadv/pwritev per member. Each member has*/
+/*a thread so the members of a run are transferred in parallel.     */
+/*==================================================================*/
+
+/*Part of a run that falls on one member*/
+struct stripe_job {
+    int member;
+    struct iovec *vec;
+    int cnt;
+    off_t offset;
+    int write;
+    int result;
+    int finished;
+    struct stripe_job *next;
+};
+
+/*--------------------------------------------------------*/
+/*Member thread: transfers the jobs queued for its member */
+/*--------------------------------------------------------*/
+static void *stripe_worker(void *arg)
+{
+    struct disk_member *member = (struct disk_member*) arg;
+    disk_t *disk = member->disk;
+    struct stripe_job *job;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&disk->stripe_lock);
+        while (member->queue == NULL && !disk->stripe_stopping)
+            pthread_cond_wait(&member->work, &disk->stripe_lock);
+        if (member->queue == NULL)
+        {
+            pthread_mutex_unlock(&disk->stripe_lock);
+            return NULL;
+        }
+        job = member->queue;
+        member->queue = job->next;
+        pthread_mutex_unlock(&disk->stripe_lock);
+
+        job->result = transfer_run(member->fd, job->vec, job->cnt, job->offset, job->write);
+
+        pthread_mutex_lock(&disk->stripe_lock);
+        job->finished = 1;
+        pthread_cond_broadcast(&disk->stripe_done);
+        pthread_mutex_unlock(&disk->stripe_lock);
+    }
+}
+
+/*------------------------------------------------------------*/
+/*Starts one thread per member the first time in this process */
+/*(locked). The lock and conditions are set up by disk_open   */
+/*------------------------------------------------------------*/
+static void stripe_start(disk_t *disk)
+{
+    int i;
+
+    if (disk->stripe_pid == getpid() && disk->stripe_nthreads == disk->nmembers)
+        return;
+
+    /*Threads inherited through fork do not exist in the child*/
+    disk->stripe_pid = getpid();
+    disk->stripe_stopping = 0;
+    disk->stripe_nthreads = 0;
+    for (i = 0; i < disk->nmembers; i++)
+    {
+        disk->member[i].queue = NULL;
+        if (pthread_create(&disk->member[i].thread, NULL, stripe_worker, &disk->member[i]) != 0)
+            break;
+        disk->stripe_nthreads++;
+    }
+}
+
+/*------------------------------------------------------------*/
+/*Stops the member threads, called when the disk is closed    */
+/*------------------------------------------------------------*/
+static void stripe_stop(disk_t *disk)
+{
+    int i;
+
+    if (disk->stripe_pid != getpid() || disk->stripe_nthreads == 0)
+        return;
+
+    pthread_mutex_lock(&disk->stripe_lock);
+    disk->stripe_stopping = 1;
+    for (i = 0; i < disk->stripe_nthreads; i++)
+        pthread_cond_signal(&disk->member[i].work);
+    pthread_mutex_unlock(&disk->stripe_lock);
+    for (i = 0; i < disk->stripe_nthreads; i++)
+        pthread_join(disk->member[i].thread, NULL);
+    disk->stripe_nthreads = 0;
+    disk->stripe_pid = 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Transfers a run of nblocks logical blocks starting at start_address*/
+/*whose memory is described by vec, splitting it across the members */
+/*------------------------------------------------------------------*/
+static int transfer_striped(disk_t *disk, struct iovec *vec, int cnt, int start_address, int nblocks, int write)
+{
+    struct stripe_job jobs[DISK_MAX_STRIPES];
+    struct iovec *slices;
+    int nmembers = disk->nmembers;
+    int stripe_unit = disk->STRIPE_UNIT;
+    int slice_cap, member, b, chunk, used, i, failed;
+    size_t vec_off, left, len;
+
+    /*Every chunk adds one slice, plus one per user buffer it crosses*/
+    slice_cap = nblocks / stripe_unit + 2 + cnt;
+    slices = (struct iovec*) malloc(sizeof(struct iovec) * slice_cap * nmembers);
+    if (slices == NULL)
+        return -1;
+
+    for (i = 0; i < nmembers; i++)
+    {
+        jobs[i].member = i;
+        jobs[i].vec = &slices[i * slice_cap];
+        jobs[i].cnt = 0;
+        jobs[i].write = write;
+        jobs[i].result = 0;
+        jobs[i].finished = 0;
+        jobs[i].next = NULL;
+    }
+
+    /*Walk the run one stripe unit at a time, handing the memory to the member holding it*/
+    vec_off = 0;
+    for (b = start_address; b < start_address + nblocks; b += chunk)
+    {
+        int unit = b / stripe_unit;
+        struct stripe_job *job;
+
+        chunk = stripe_unit - b % stripe_unit;
+        if (chunk > start_address + nblocks - b)
+            chunk = start_address + nblocks - b;
+
+        member = unit % nmembers;
+        job = &jobs[member];
+        if (job->cnt == 0)
+            job->offset = ((off_t) (unit / nmembers) * stripe_unit + b % stripe_unit) * disk->BLOCK_SIZE;
+
+        for (left = (size_t) chunk * disk->BLOCK_SIZE; left > 0; left -= len)
+        {
+            len = vec->iov_len - vec_off;
+            if (len > left)
+                len = left;
+            job->vec[job->cnt].iov_base = (char*) vec->iov_base + vec_off;
+            job->vec[job->cnt].iov_len = len;
+            job->cnt++;
+            vec_off += len;
+            if (vec_off == vec->iov_len)
+            {
+                vec++;
+                vec_off = 0;
+            }
+        }
+    }
+
+    /*Hand every member but the first one used to its thread, transfer that one here*/
+    used = -1;
+    pthread_mutex_lock(&disk->stripe_lock);
+    stripe_start(disk);
+    for (i = 0; i < nmembers; i++)
+    {
+        if (jobs[i].cnt == 0)
+        {
+            jobs[i].finished = 1;
+            continue;
+        }
+        if (used == -1 || i >= disk->stripe_nthreads)
+        {
+            if (used == -1)
+                used = i;
+            continue;
+        }
+        jobs[i].next = disk->member[i].queue;
+        disk->member[i].queue = &jobs[i];
+        pthread_cond_signal(&disk->member[i].work);
+    }
+    pthread_mutex_unlock(&disk->stripe_lock);
+
+    for (i = 0; i < nmembers; i++)
+    {
+        if (!jobs[i].finished && (i == used || i >= disk->stripe_nthreads))
+        {
+            jobs[i].result = transfer_run(disk->member[i].fd, jobs[i].vec, jobs[i].cnt, jobs[i].offset, write);
+            jobs[i].finished = 1;
+        }
+    }
+
+    failed = 0;
+    pthread_mutex_lock(&disk->stripe_lock);
+    for (i = 0; i < nmembers; i++)
+    {
+        while (!jobs[i].finished)
+            pthread_cond_wait(&disk->stripe_done, &disk->stripe_lock);
+        if (jobs[i].result == -1)
+            failed = -1;
+    }
+    pthread_mutex_unlock(&disk->stripe_lock);
+
+    free(slices);
+    return failed;
+}
+
+/*------------------------------------------------------------------*/
+/*Transfers one run of contiguous logical blocks                    */
+/*------------------------------------------------------------------*/
+static int transfer_blocks_run(disk_t *disk, struct iovec *vec, int cnt, int start_address, int nblocks, int write)
+{
+    if (disk->nmembers > 1)
+        return transfer_striped(disk, vec, cnt, start_address, nblocks, write);
+    return transfer_run(disk->fd, vec, cnt, (off_t) start_address * disk->BLOCK_SIZE, write);
+}
+
+/*-------------------------------------------------------------------*/
+/*Transfers a vector of block ranges. Ranges that follow each other on*/
+/*disk are merged into one preadv/pwritev, so one call is issued per  */
+/*contiguous run rather than per range or per block                   */
+/*-------------------------------------------------------------------*/
+static int transfer_ranges(disk_t *disk, const struct blk_iovec *iov, int n, int write)
+{
+    struct iovec vec[IOV_MAX];
+    int i, cnt, run_start, run_end, e, s;
+    e = 0;
+    s = 0;
+
+    /*Mapped image: every range is a plain memory copy*/
+    if (disk->map != NULL)
+    {
+        for (i = 0; i < n; i++)
+        {
+            char *block = disk->map + (size_t) iov[i].start_address * disk->BLOCK_SIZE;
+            size_t len = (size_t) iov[i].nblocks * disk->BLOCK_SIZE;
+
+            if (iov[i].nblocks == 0)
+                continue;
+            stats_position(disk, iov[i].start_address, iov[i].nblocks);
+            if (device_service(disk, iov[i].start_address, iov[i].nblocks) == -1)
+            {
+                e -= iov[i].nblocks;
+                continue;
+            }
+            if (write)
+                memcpy(block, iov[i].buffer, len);
+            else
+                memcpy(iov[i].buffer, block, len);
+            s += iov[i].nblocks;
+        }
+        return e == 0 ? s : e;
+    }
+
+    cnt = 0;
+    run_start = run_end = 0;
+    for (i = 0; i < n; i++)
+    {
+        if (iov[i].nblocks == 0)
+            continue;
+
+        /*Flush the current run when this range does not extend it*/
+        if (cnt > 0 && (iov[i].start_address != run_end || cnt == IOV_MAX))
+        {
+            stats_position(disk, run_start, run_end - run_start);
+            if (device_service(disk, run_start, run_end - run_start) == -1 ||
+                transfer_blocks_run(disk, vec, cnt, run_start, run_end - run_start, write) == -1)
+                e -= run_end - run_start;
+            else
+                s += run_end - run_start;
+            cnt = 0;
+        }
+        if (cnt == 0)
+            run_start = run_end = iov[i].start_address;
+
+        vec[cnt].iov_base = iov[i].buffer;
+        vec[cnt].iov_len = (size_t) iov[i].nblocks * disk->BLOCK_SIZE;
+        cnt++;
+        run_end += iov[i].nblocks;
+    }
+    if (cnt > 0)
+    {
+        stats_position(disk, run_start, run_end - run_start);
+        if (device_service(disk, run_start, run_end - run_start) == -1 ||
+            transfer_blocks_run(disk, vec, cnt, run_start, run_end - run_start, write) == -1)
+            e -= run_end - run_start;
+        else
+            s += run_end - run_start;
+    }
+
+    /*If no failure return the number of blocks transferred, else return the negative number of failures*/
+    if (e == 0)
+        return s;
+    else
+        return e;
+}
+
+/*-------------------------------------------------------------------*/
+/*Transfers block ranges to/from the image itself, keeping the stats  */
+/*-------------------------------------------------------------------*/
+static int physical_io(disk_t *disk, const struct blk_iovec *iov, int n, int write)
+{
+    unsigned long long start = clock_ns();
+    int result;
+
+    result = transfer_ranges(disk, iov, n, write);
+    stats_account(disk, write ? &disk->stats.write : &disk->stats.read, result, start);
+    /*One copy per block moved, by the kernel or out of the mapping*/
+    if (result > 0)
+        stats_copied(disk, result);
+    return result;
+}
+
+/*==================================================================*/
+/*Buffer cache                                                      */
+/*                                                                  */
+/*Keeps up to cache_capacity blocks of a disk in memory. Reads of   */
+/*cached blocks and all writes of small ranges stay in memory, dirty*/
+/*blocks go out when they are evicted or at disk_flush/disk_sync.   */
+/*Ranges larger than half the cache go straight to the image so a   */
+/*big transfer does not flush the working set out of the cache.     */
+/*==================================================================*/
+
+struct cache_entry {
+    int block;
+    int dirty;
+    /*CLOCK reference bit*/
+    int referenced;
+    int hash_next;
+    /*LRU list links*/
+    int prev, next;
+};
+
+/*------------------------------------------------------------------*/
+/*Chooses the cache of the disks opened from now on: capacity in    */
+/*blocks (0 for none) and eviction policy. Without a call, the sizes*/
+/*come from DISK_EMU_CACHE_BLOCKS and DISK_EMU_CACHE_POLICY=lru|clock*/
+/*------------------------------------------------------------------*/
+int disk_set_cache(int capacity_blocks, int policy)
+{
+    if (capacity_blocks < 0 || (policy != DISK_CACHE_LRU && policy != DISK_CACHE_CLOCK))
+    {
+        printf("Invalid cache of %d blocks, policy %d\n", capacity_blocks, policy);
+        return -1;
+    }
+    cache_explicit = 1;
+    cache_blocks = capacity_blocks;
+    cache_policy = policy;
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Allocates the cache of a newly opened disk                        */
+/*------------------------------------------------------------------*/
+static void cache_setup(disk_t *disk)
+{
+    int capacity = cache_blocks;
+    int policy = cache_policy;
+    int i, buckets;
+    char *value;
+
+    if (!cache_explicit)
+    {
+        capacity = 0;
+        policy = DISK_CACHE_CLOCK;
+        if ((value = getenv("DISK_EMU_CACHE_BLOCKS")) != NULL)
+            capacity = atoi(value);
+        if ((value = getenv("DISK_EMU_CACHE_POLICY")) != NULL && strcmp(value, "lru") == 0)
+            policy = DISK_CACHE_LRU;
+    }
+    /*A mapped image is served from memory already*/
+    if (capacity <= 0 || disk->map != NULL)
+        return;
+    if (capacity > disk->MAX_BLOCK)
+        capacity = disk->MAX_BLOCK;
+
+    for (buckets = 1; buckets < 2 * capacity; buckets <<= 1)
+        ;
+    disk->cache = (struct cache_entry*) malloc(sizeof(struct cache_entry) * capacity);
+    disk->cache_data = (char*) malloc((size_t) capacity * disk->BLOCK_SIZE);
+    disk->cache_hash = (int*) malloc(sizeof(int) * buckets);
+    if (disk->cache == NULL || disk->cache_data == NULL || disk->cache_hash == NULL)
+    {
+        printf("Could not allocate a cache of %d blocks\n", capacity);
+        cache_free(disk);
+        return;
+    }
+    for (i = 0; i < buckets; i++)
+        disk->cache_hash[i] = -1;
+    disk->cache_hash_mask = buckets - 1;
+    disk->cache_capacity = capacity;
+    disk->cache_policy = policy;
+    disk->cache_used = 0;
+    disk->cache_hand = 0;
+    disk->lru_head = disk->lru_tail = -1;
+    disk->cache_dirty = 0;
+}
+
+static void cache_free(disk_t *disk)
+{
+    free(disk->cache);
+    free(disk->cache_data);
+    free(disk->cache_hash);
+    disk->cache = NULL;
+    disk->cache_data = NULL;
+    disk->cache_hash = NULL;
+    disk->cache_capacity = 0;
+}
+
+static char *cache_block(disk_t *disk, int entry)
+{
+    return disk->cache_data + (size_t) entry * disk->BLOCK_SIZE;
+}
+
+/*------------------------------------------------------------------*/
+/*Returns the entry holding block, -1 if it is not cached           */
+/*------------------------------------------------------------------*/
+static int cache_lookup(disk_t *disk, int block)
+{
+    int entry = disk->cache_hash[block & disk->cache_hash_mask];
+
+    while (entry != -1 && disk->cache[entry].block != block)
+        entry = disk->cache[entry].hash_next;
+    return entry;
+}
+
+static void lru_unlink(disk_t *disk, int entry)
+{
+    struct cache_entry *e = &disk->cache[entry];
+
+    if (e->prev == -1)
+        disk->lru_head = e->next;
+    else
+        disk->cache[e->prev].next = e->next;
+    if (e->next == -1)
+        disk->lru_tail = e->prev;
+    else
+        disk->cache[e->next].prev = e->prev;
+}
+
+static void lru_push(disk_t *disk, int entry)
+{
+    struct cache_entry *e = &disk->cache[entry];
+
+    e->prev = -1;
+    e->next = disk->lru_head;
+    if (disk->lru_head != -1)
+        disk->cache[disk->lru_head].prev = entry;
+    disk->lru_head = entry;
+    if (disk->lru_tail == -1)
+        disk->lru_tail = entry;
+}
+
+/*------------------------------------------------------------------*/
+/*Records a use of an entry for the eviction policy                 */
+/*------------------------------------------------------------------*/
+static void cache_touch(disk_t *disk, int entry)
+{
+    if (disk->cache_policy == DISK_CACHE_LRU)
+    {
+        lru_unlink(disk, entry);
+        lru_push(disk, entry);
+    }
+    else
+        disk->cache[entry].referenced = 1;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes one dirty entry back to the image. It stays dirty if the   */
+/*write fails                                                       */
+/*------------------------------------------------------------------*/
+static int cache_write_entry(disk_t *disk, int entry)
+{
+    struct blk_iovec iov;
+
+    iov.start_address = disk->cache[entry].block;
+    iov.nblocks = 1;
+    iov.buffer = cache_block(disk, entry);
+    if (physical_io(disk, &iov, 1, 1) != 1)
+        return -1;
+    disk->cache[entry].dirty = 0;
+    disk->cache_dirty--;
+    stats_cache(disk, 0, 0, 1);
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Frees an entry for a new block: a never used one while there are  */
+/*some, else the LRU tail or the first unreferenced one under the   */
+/*CLOCK hand. A dirty victim is written back first, if that fails it*/
+/*stays cached and -1 is returned                                   */
+/*------------------------------------------------------------------*/
+static int cache_evict(disk_t *disk)
+{
+    int entry, *link;
+
+    if (disk->cache_used < disk->cache_capacity)
+        return disk->cache_used++;
+
+    if (disk->cache_policy == DISK_CACHE_LRU)
+        entry = disk->lru_tail;
+    else
+    {
+        while (disk->cache[disk->cache_hand].referenced)
+        {
+            disk->cache[disk->cache_hand].referenced = 0;
+            disk->cache_hand = (disk->cache_hand + 1) % disk->cache_capacity;
+        }
+        entry = disk->cache_hand;
+        disk->cache_hand = (disk->cache_hand + 1) % disk->cache_capacity;
+    }
+
+    if (disk->cache[entry].dirty && cache_write_entry(disk, entry) == -1)
+    {
+        printf("Could not write back block %d\n", disk->cache[entry].block);
+        return -1;
+    }
+    if (disk->cache_policy == DISK_CACHE_LRU)
+        lru_unlink(disk, entry);
+
+    link = &disk->cache_hash[disk->cache[entry].block & disk->cache_hash_mask];
+    while (*link != entry)
+        link = &disk->cache[*link].hash_next;
+    *link = disk->cache[entry].hash_next;
+    return entry;
+}
+
+/*------------------------------------------------------------------*/
+/*Gives block an entry, whose data the caller fills in. Returns -1  */
+/*when no entry could be freed                                      */
+/*------------------------------------------------------------------*/
+static int cache_insert(disk_t *disk, int block)
+{
+    int entry = cache_evict(disk);
+    int *bucket = &disk->cache_hash[block & disk->cache_hash_mask];
+
+    if (entry == -1)
+        return -1;
+    disk->cache[entry].block = block;
+    disk->cache[entry].dirty = 0;
+    disk->cache[entry].referenced = 1;
+    disk->cache[entry].hash_next = *bucket;
+    *bucket = entry;
+    if (disk->cache_policy == DISK_CACHE_LRU)
+        lru_push(disk, entry);
+    return entry;
+}
+
+static int compare_entry_blocks(const void *a, const void *b)
+{
+    return ((const struct blk_iovec*) a)->start_address - ((const struct blk_iovec*) b)->start_address;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes every dirty block back, in address order so neighbouring   */
+/*blocks are merged into a single pwritev (locked)                  */
+/*------------------------------------------------------------------*/
+static int cache_writeback(disk_t *disk)
+{
+    struct blk_iovec *iov;
+    int i, n = 0, ret = 0;
+
+    if (disk->cache == NULL || disk->cache_dirty == 0)
+        return 0;
+
+    iov = (struct blk_iovec*) malloc(sizeof(struct blk_iovec) * disk->cache_dirty);
+    /*The blocks stay dirty, a later flush writes them back*/
+    if (iov == NULL)
+        return -1;
+    for (i = 0; i < disk->cache_used; i++)
     {
-        fclose(fp);
+        if (!disk->cache[i].dirty)
+            continue;
+        iov[n].start_address = disk->cache[i].block;
+        iov[n].nblocks = 1;
+        iov[n].buffer = cache_block(disk, i);
+        n++;
     }
-    return 0;
+    qsort(iov, n, sizeof(struct blk_iovec), compare_entry_blocks);
+    if (physical_io(disk, iov, n, 1) == n)
+    {
+        for (i = 0; i < n; i++)
+            disk->cache[((char*) iov[i].buffer - disk->cache_data) / disk->BLOCK_SIZE].dirty = 0;
+        disk->cache_dirty -= n;
+        stats_cache(disk, 0, 0, n);
+    }
+    else
+    {
+        /*Some runs failed, write the blocks one by one to tell which ones are still dirty*/
+        for (i = 0; i < n; i++)
+            if (cache_write_entry(disk, ((char*) iov[i].buffer - disk->cache_data) / disk->BLOCK_SIZE) == -1)
+                ret = -1;
+    }
+    free(iov);
+    return ret;
 }
 
-/*---------------------------------------*/
-/*Initializes a disk file filled with 0's*/
-/*---------------------------------------*/
-int init_fresh_disk(char *filename, int block_size, int num_blocks)
+/*------------------------------------------------------------------*/
+/*Reads one range through the cache (locked). Runs of missing blocks*/
+/*are read with one call each, straight into the caller's buffer    */
+/*------------------------------------------------------------------*/
+static int cache_read(disk_t *disk, const struct blk_iovec *range, int keep)
 {
-    int i, j;
-    
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
-
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
-    /*Initializes the random number generator*/
-    srand((unsigned int)(time( 0 )) );
-    /*Creates a new file*/
-    fp = fopen (filename, "w+b");
+    struct blk_iovec miss;
+    int b, entry, run, got, e = 0, s = 0, hits = 0, misses = 0, copies = 0;
+    char *buffer = (char*) range->buffer;
 
-    if (fp == NULL)
+    for (b = 0; b < range->nblocks; b += run)
     {
-        printf("Could not create new disk file %s\n\n", filename);
-        return -1;
+        entry = cache_lookup(disk, range->start_address + b);
+        if (entry != -1)
+        {
+            memcpy(buffer + (size_t) b * disk->BLOCK_SIZE, cache_block(disk, entry), disk->BLOCK_SIZE);
+            cache_touch(disk, entry);
+            hits++;
+            s++;
+            run = 1;
+            continue;
+        }
+
+        for (run = 1; b + run < range->nblocks && cache_lookup(disk, range->start_address + b + run) == -1; run++)
+            ;
+        miss.start_address = range->start_address + b;
+        miss.nblocks = run;
+        miss.buffer = buffer + (size_t) b * disk->BLOCK_SIZE;
+        misses += run;
+        got = physical_io(disk, &miss, 1, 0);
+        if (got != run)
+        {
+            e -= run;
+            continue;
+        }
+        s += run;
+        for (got = 0; keep && got < run; got++)
+        {
+            /*The caller has the data already, it just is not kept*/
+            entry = cache_insert(disk, miss.start_address + got);
+            if (entry == -1)
+                break;
+            memcpy(cache_block(disk, entry), (char*) miss.buffer + (size_t) got * disk->BLOCK_SIZE, disk->BLOCK_SIZE);
+            copies++;
+        }
     }
-    
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
+    stats_cache(disk, hits, misses, 0);
+    stats_copied(disk, hits + copies);
+    return e == 0 ? s : e;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes one range into the cache, marking the blocks dirty (locked)*/
+/*------------------------------------------------------------------*/
+static int cache_write(disk_t *disk, const struct blk_iovec *range)
+{
+    struct blk_iovec through;
+    int b, entry, e = 0, copies = 0;
+
+    for (b = 0; b < range->nblocks; b++)
     {
-        for (j = 0; j < BLOCK_SIZE; j++)
+        entry = cache_lookup(disk, range->start_address + b);
+        if (entry == -1)
+            entry = cache_insert(disk, range->start_address + b);
+        else
+            cache_touch(disk, entry);
+        /*No room in the cache, the block goes straight to the image*/
+        if (entry == -1)
+        {
+            through.start_address = range->start_address + b;
+            through.nblocks = 1;
+            through.buffer = (char*) range->buffer + (size_t) b * disk->BLOCK_SIZE;
+            if (physical_io(disk, &through, 1, 1) != 1)
+                e--;
+            continue;
+        }
+        memcpy(cache_block(disk, entry), (char*) range->buffer + (size_t) b * disk->BLOCK_SIZE, disk->BLOCK_SIZE);
+        if (!disk->cache[entry].dirty)
         {
-            fputc(0, fp);
+            disk->cache[entry].dirty = 1;
+            disk->cache_dirty++;
         }
+        copies++;
     }
-    return 0;
+    stats_copied(disk, copies);
+    return e == 0 ? range->nblocks : e;
 }
-/*----------------------------*/
-/*Initializes an existing disk*/
-/*----------------------------*/
-int init_disk(char *filename, int block_size, int num_blocks)
+
+/*------------------------------------------------------------------*/
+/*Writes a large range straight to the image, refreshing the cached */
+/*copies it overwrites (locked)                                     */
+/*------------------------------------------------------------------*/
+static int cache_write_around(disk_t *disk, const struct blk_iovec *range)
 {
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
+    int b, entry, result, copies = 0;
 
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
-    /*Initializes the random number generator*/
-    srand((unsigned int)(time( 0 )) );
-    
-    /*Opens a file*/
-    fp = fopen (filename, "r+b");
+    result = physical_io(disk, range, 1, 1);
+    for (b = 0; b < range->nblocks; b++)
+    {
+        entry = cache_lookup(disk, range->start_address + b);
+        if (entry == -1)
+            continue;
+        memcpy(cache_block(disk, entry), (char*) range->buffer + (size_t) b * disk->BLOCK_SIZE, disk->BLOCK_SIZE);
+        copies++;
+        if (disk->cache[entry].dirty && result == range->nblocks)
+        {
+            disk->cache[entry].dirty = 0;
+            disk->cache_dirty--;
+        }
+    }
+    stats_copied(disk, copies);
+    return result;
+}
+
+/*------------------------------------------------------------------*/
+/*Transfers a vector of block ranges through the cache              */
+/*------------------------------------------------------------------*/
+static int cache_transfer(disk_t *disk, const struct blk_iovec *iov, int n, int write)
+{
+    int i, result, e = 0, s = 0;
+    int large = disk->cache_capacity / 2;
+
+    pthread_mutex_lock(&disk->cache_lock);
+    for (i = 0; i < n; i++)
+    {
+        if (iov[i].nblocks == 0)
+            continue;
+        if (!write)
+            result = cache_read(disk, &iov[i], iov[i].nblocks <= large);
+        else if (iov[i].nblocks <= large)
+            result = cache_write(disk, &iov[i]);
+        else
+            result = cache_write_around(disk, &iov[i]);
 
-    if (fp == NULL)
+        if (result < 0)
+            e += result;
+        else
+            s += result;
+    }
+    pthread_mutex_unlock(&disk->cache_lock);
+    return e == 0 ? s : e;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes the dirty blocks of a disk's cache back to its image,      */
+/*without asking for durability (see disk_sync for that)            */
+/*------------------------------------------------------------------*/
+int disk_flush(disk_t *disk)
+{
+    int ret;
+
+    if (disk == NULL || disk->fd == -1)
+        return -1;
+    if (disk->cache == NULL)
+        return 0;
+
+    pthread_mutex_lock(&disk->cache_lock);
+    ret = cache_writeback(disk);
+    pthread_mutex_unlock(&disk->cache_lock);
+    return ret;
+}
+
+/*------------------------------------------------------------------*/
+/*disk_flush on the default disk                                    */
+/*------------------------------------------------------------------*/
+int flush_blocks()
+{
+    return disk_flush(default_disk);
+}
+
+/*-------------------------------------------------------------------*/
+/*Checks and transfers a vector of block ranges, through the cache    */
+/*when the disk has one                                               */
+/*-------------------------------------------------------------------*/
+static int transfer_blocks_v(disk_t *disk, const struct blk_iovec *iov, int n, int write)
+{
+    if (disk == NULL || disk->fd == -1)
     {
-        printf("Could not open %s\n\n", filename);
+        printf("disk is not initialized\n");
         return -1;
     }
-    return 0;
+    if (check_blk_iovec(disk, iov, n) == -1)
+        return -1;
+
+    if (disk->cache != NULL)
+        return cache_transfer(disk, iov, n, write);
+    return physical_io(disk, iov, n, write);
+}
+
+/*-------------------------------------------------------------------*/
+/*Reads a vector of block ranges from a disk                          */
+/*-------------------------------------------------------------------*/
+int disk_read_v(disk_t *disk, const struct blk_iovec *iov, int n)
+{
+    return transfer_blocks_v(disk, iov, n, 0);
+}
+
+/*-------------------------------------------------------------------*/
+/*Writes a vector of block ranges to a disk                           */
+/*-------------------------------------------------------------------*/
+int disk_write_v(disk_t *disk, const struct blk_iovec *iov, int n)
+{
+    return transfer_blocks_v(disk, iov, n, 1);
+}
+
+/*-------------------------------------------------------------------*/
+/*Reads a series of blocks from a disk into the buffer               */
+/*-------------------------------------------------------------------*/
+int disk_read(disk_t *disk, int start_address, int nblocks, void *buffer)
+{
+    struct blk_iovec iov;
+
+    iov.start_address = start_address;
+    iov.nblocks = nblocks;
+    iov.buffer = buffer;
+    return transfer_blocks_v(disk, &iov, 1, 0);
+}
+
+/*------------------------------------------------------------------*/
+/*Writes a series of blocks to a disk from the buffer               */
+/*------------------------------------------------------------------*/
+int disk_write(disk_t *disk, int start_address, int nblocks, void *buffer)
+{
+    struct blk_iovec iov;
+
+    iov.start_address = start_address;
+    iov.nblocks = nblocks;
+    iov.buffer = buffer;
+    return transfer_blocks_v(disk, &iov, 1, 1);
+}
+
+/*-------------------------------------------------------------------*/
+/*Reads a vector of block ranges from the disk                        */
+/*-------------------------------------------------------------------*/
+int read_blocks_v(const struct blk_iovec *iov, int n)
+{
+    return disk_read_v(default_disk, iov, n);
+}
+
+/*-------------------------------------------------------------------*/
+/*Writes a vector of block ranges to the disk                         */
+/*-------------------------------------------------------------------*/
+int write_blocks_v(const struct blk_iovec *iov, int n)
+{
+    return disk_write_v(default_disk, iov, n);
 }
 
 /*-------------------------------------------------------------------*/
@@ -95,86 +1820,525 @@ int init_disk(char *filename, int block_size, int num_blocks)
 /*-------------------------------------------------------------------*/
 int read_blocks(int start_address, int nblocks, void *buffer)
 {
-    int i, j, e, s;
-    e = 0;
-    s = 0;
+    return disk_read(default_disk, start_address, nblocks, buffer);
+}
+
+/*------------------------------------------------------------------*/
+/*Writes a series of blocks to the disk from the buffer             */
+/*------------------------------------------------------------------*/
+int write_blocks(int start_address, int nblocks, void *buffer)
+{
+    return disk_write(default_disk, start_address, nblocks, buffer);
+}
 
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
+/*==================================================================*/
+/*Asynchronous block I/O                                            */
+/*                                                                  */
+/*Requests are submitted with submit_read/submit_write and reaped   */
+/*with poll_completions. They run on io_uring when the kernel has   */
+/*it, otherwise on a small pool of worker threads doing pread/pwrite.*/
+/*Set DISK_EMU_ASYNC=threads to force the thread pool.              */
+/*==================================================================*/
 
-    /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+/*Most requests in flight at once, also the io_uring ring size*/
+#define ASYNC_DEPTH 64
+/*Worker threads of the fallback engine*/
+#define ASYNC_WORKERS 4
+
+struct async_req {
+    disk_t *disk;
+    int write;
+    int start_address;
+    int nblocks;
+    char *buffer;
+    /*Bytes already moved, io_uring may transfer a request in pieces*/
+    size_t done;
+    void *user_data;
+    int result;
+    /*When the request was submitted, for the latency statistics*/
+    unsigned long long submitted;
+    struct async_req *next;
+};
+
+/*Engine state belongs to the process that started it, a forked child starts its own*/
+static pid_t async_pid = 0;
+static int async_inflight = 0;
+/*Requests waiting for a worker thread*/
+static struct async_req *pending_head = NULL, *pending_tail = NULL;
+/*Completed requests not yet returned by poll_completions*/
+static struct async_req *done_head = NULL, *done_tail = NULL;
+static int done_count = 0;
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t async_done = PTHREAD_COND_INITIALIZER;
+static int use_uring = 0;
+/*Requests in flight on the ring, the others are with the thread pool*/
+static int uring_inflight = 0;
+/*A thread is waiting in the kernel for ring completions, the others wait on async_done*/
+static int uring_waiting = 0;
+static int async_nworkers = 0;
+
+#ifdef __linux__
+/*Shared io_uring rings, mapped from the kernel*/
+static struct {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+} ring;
+
+/*----------------------------------------------------------------*/
+/*Sets up an io_uring instance, returns -1 if the kernel lacks one*/
+/*----------------------------------------------------------------*/
+static int uring_setup()
+{
+    struct io_uring_params params;
+    size_t sq_len, cq_len;
+    char *rings;
+
+    memset(&params, 0, sizeof(params));
+    ring.fd = syscall(__NR_io_uring_setup, ASYNC_DEPTH, &params);
+    if (ring.fd < 0)
+        return -1;
+
+    /*Plain READ/WRITE opcodes arrived together with FAST_POLL*/
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_FAST_POLL))
     {
-        printf("out of bound error %d\n", start_address);
+        close(ring.fd);
         return -1;
     }
 
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_len > sq_len)
+        sq_len = cq_len;
 
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i)
+    rings = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED)
     {
-        /*Pause until the latency duration is elapsed*/
-        // usleep(L);
+        close(ring.fd);
+        return -1;
+    }
+    ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED)
+    {
+        munmap(rings, sq_len);
+        close(ring.fd);
+        return -1;
+    }
+
+    ring.sq_tail = (unsigned*) (rings + params.sq_off.tail);
+    ring.sq_mask = (unsigned*) (rings + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned*) (rings + params.sq_off.array);
+    ring.cq_head = (unsigned*) (rings + params.cq_off.head);
+    ring.cq_tail = (unsigned*) (rings + params.cq_off.tail);
+    ring.cq_mask = (unsigned*) (rings + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*) (rings + params.cq_off.cqes);
+    return 0;
+}
+
+/*-------------------------------------------------------------*/
+/*Queues what is left of a request on the ring and submits it  */
+/*-------------------------------------------------------------*/
+static void uring_queue(struct async_req *req)
+{
+    unsigned tail = *ring.sq_tail;
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = req->disk->fd;
+    sqe->off = (off_t) req->start_address * req->disk->BLOCK_SIZE + req->done;
+    sqe->addr = (unsigned long) (req->buffer + req->done);
+    sqe->len = (size_t) req->nblocks * req->disk->BLOCK_SIZE - req->done;
+    sqe->user_data = (unsigned long) req;
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    syscall(__NR_io_uring_enter, ring.fd, 1, 0, 0, NULL, 0);
+}
+#endif
+
+/*---------------------------------------------------------*/
+/*Moves a finished request to the completion list (locked) */
+/*---------------------------------------------------------*/
+static void async_complete(struct async_req *req)
+{
+    req->next = NULL;
+    if (done_tail == NULL)
+        done_head = req;
+    else
+        done_tail->next = req;
+    done_tail = req;
+    done_count++;
+    async_inflight--;
+    pthread_cond_broadcast(&async_done);
+}
+
+#ifdef __linux__
+/*-----------------------------------------------------------------*/
+/*Reaps io_uring completions, waiting for at least wait_nr of them */
+/*(locked). The lock is dropped while waiting in the kernel, and a */
+/*single thread waits there at a time: it reaps for the others     */
+/*-----------------------------------------------------------------*/
+static void uring_reap(int wait_nr)
+{
+    unsigned head;
+
+    if (uring_waiting)
+    {
+        if (wait_nr > 0)
+            pthread_cond_wait(&async_done, &async_lock);
+        return;
+    }
+    if (wait_nr > 0)
+    {
+        uring_waiting = 1;
+        pthread_mutex_unlock(&async_lock);
+        syscall(__NR_io_uring_enter, ring.fd, 0, wait_nr, IORING_ENTER_GETEVENTS, NULL, 0);
+        pthread_mutex_lock(&async_lock);
+        uring_waiting = 0;
+        /*Threads that waited on this one check again, even if nothing completed*/
+        pthread_cond_broadcast(&async_done);
+    }
 
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
+    head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        struct async_req *req = (struct async_req*) (unsigned long) cqe->user_data;
+        int res = cqe->res;
+        head++;
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
 
-       for (j = 0; j < BLOCK_SIZE; j++)
+        /*Interrupted or short transfer: send the rest again*/
+        if (res == -EINTR || res == -EAGAIN ||
+            (res > 0 && req->done + res < (size_t) req->nblocks * req->disk->BLOCK_SIZE))
         {
-            memcpy(buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
+            if (res > 0)
+                req->done += res;
+            uring_queue(req);
+            continue;
         }
+        /*Same convention as read_blocks: blocks moved, or minus the blocks that failed*/
+        req->result = res > 0 ? req->nblocks : -req->nblocks;
+        stats_account(req->disk, req->write ? &req->disk->stats.write : &req->disk->stats.read,
+                      req->result, req->submitted);
+        if (res > 0)
+            stats_copied(req->disk, req->nblocks);
+        uring_inflight--;
+        async_complete(req);
     }
+}
+#endif
 
-    free(blockRead);
+/*----------------------------------------------------------*/
+/*Worker thread of the fallback engine                      */
+/*----------------------------------------------------------*/
+static void *async_worker(void *arg)
+{
+    struct async_req *req;
+    struct blk_iovec iov;
 
+    (void) arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&async_lock);
+        while (pending_head == NULL)
+            pthread_cond_wait(&async_work, &async_lock);
+        req = pending_head;
+        pending_head = req->next;
+        if (pending_head == NULL)
+            pending_tail = NULL;
+        pthread_mutex_unlock(&async_lock);
 
-    /*If no failure return the number of blocks read, else return the negative number of failures*/
-    if (e == 0)
-        return s;
-    else
-        return e;
+        iov.start_address = req->start_address;
+        iov.nblocks = req->nblocks;
+        iov.buffer = req->buffer;
+        req->result = transfer_blocks_v(req->disk, &iov, 1, req->write);
+
+        pthread_mutex_lock(&async_lock);
+        async_complete(req);
+        pthread_mutex_unlock(&async_lock);
+    }
+    return NULL;
 }
 
 /*------------------------------------------------------------------*/
-/*Writes a series of blocks to the disk from the buffer             */
+/*Starts the engine the first time it is used in this process       */
 /*------------------------------------------------------------------*/
-int write_blocks(int start_address, int nblocks, void *buffer)
+static void async_start()
 {
-    int i, e, s;
-    e = 0;
-    s = 0;
+    char *engine;
+
+    if (async_pid == getpid())
+        return;
+
+    /*State inherited through fork belongs to the parent: forget it*/
+    pthread_mutex_init(&async_lock, NULL);
+    pthread_cond_init(&async_work, NULL);
+    pthread_cond_init(&async_done, NULL);
+    pending_head = pending_tail = NULL;
+    done_head = done_tail = NULL;
+    done_count = 0;
+    async_inflight = 0;
+    uring_inflight = 0;
+    uring_waiting = 0;
+    async_pid = getpid();
+
+    engine = getenv("DISK_EMU_ASYNC");
+    use_uring = 0;
+#ifdef __linux__
+    if (engine == NULL || strcmp(engine, "threads") != 0)
+        use_uring = uring_setup() == 0;
+#endif
+    async_nworkers = 0;
+}
+
+/*==================================================================*/
+/*Fork                                                              */
+/*                                                                  */
+/*Member and worker threads hold the locks of a disk for short      */
+/*moments. A fork landing in one of them would leave that lock taken*/
+/*for good in the child, so the forking thread first takes them all.*/
+/*The child has none of the threads that waited on the conditions,  */
+/*those start over                                                  */
+/*==================================================================*/
 
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
+/*------------------------------------------------------------------*/
+/*Takes every lock, in the order the transfer path nests them       */
+/*------------------------------------------------------------------*/
+static void fork_prepare()
+{
+    disk_t *disk;
 
-    /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    pthread_mutex_lock(&explicit_model_lock);
+    pthread_mutex_lock(&async_lock);
+    pthread_mutex_lock(&open_disks_lock);
+    for (disk = open_disks; disk != NULL; disk = disk->next_open)
     {
-        printf("out of bound error\n");
-        return -1;
+        pthread_mutex_lock(&disk->cache_lock);
+        pthread_mutex_lock(&disk->model_lock);
+        pthread_mutex_lock(&disk->stripe_lock);
+        pthread_mutex_lock(&disk->stats_lock);
     }
+}
 
-    /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+/*------------------------------------------------------------------*/
+/*Releases the locks taken by fork_prepare, in parent and child     */
+/*------------------------------------------------------------------*/
+static void fork_release()
+{
+    disk_t *disk;
 
-    /*For every block requested*/        
-    for (i = 0; i < nblocks; ++i)
+    for (disk = open_disks; disk != NULL; disk = disk->next_open)
     {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
+        pthread_mutex_unlock(&disk->stats_lock);
+        pthread_mutex_unlock(&disk->stripe_lock);
+        pthread_mutex_unlock(&disk->model_lock);
+        pthread_mutex_unlock(&disk->cache_lock);
+    }
+    pthread_mutex_unlock(&open_disks_lock);
+    pthread_mutex_unlock(&async_lock);
+    pthread_mutex_unlock(&explicit_model_lock);
+}
 
-        memcpy(blockWrite, buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
+static void fork_child()
+{
+    disk_t *disk;
+    int i;
 
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
-        s++;
+    for (disk = open_disks; disk != NULL; disk = disk->next_open)
+    {
+        pthread_cond_init(&disk->model_free, NULL);
+        pthread_cond_init(&disk->stripe_done, NULL);
+        for (i = 0; i < disk->nmembers; i++)
+            pthread_cond_init(&disk->member[i].work, NULL);
     }
-    free(blockWrite);
+    fork_release();
+}
 
-    /*If no failure return the number of blocks written, else return the negative number of failures*/
-    if (e == 0)
-        return s;
+static void fork_install()
+{
+    pthread_atfork(fork_prepare, fork_release, fork_child);
+}
+
+/*------------------------------------------------------------------*/
+/*Makes sure the thread pool can keep the modeled queue depth busy  */
+/*------------------------------------------------------------------*/
+static void async_grow_workers(disk_t *disk)
+{
+    pthread_t thread;
+    int target = ASYNC_WORKERS;
+
+    if (model_active(disk))
+        target = disk->QUEUE_DEPTH < ASYNC_DEPTH ? disk->QUEUE_DEPTH : ASYNC_DEPTH;
+
+    while (async_nworkers < target)
+    {
+        if (pthread_create(&thread, NULL, async_worker, NULL) != 0)
+            break;
+        pthread_detach(thread);
+        async_nworkers++;
+    }
+}
+
+/*---------------------------------------------------------------*/
+/*Waits until every submitted request has completed. Completions */
+/*stay queued for poll_completions                               */
+/*---------------------------------------------------------------*/
+static void async_drain()
+{
+    if (async_pid != getpid())
+        return;
+
+    pthread_mutex_lock(&async_lock);
+#ifdef __linux__
+    while (use_uring && uring_inflight > 0)
+        uring_reap(1);
+#endif
+    while (async_inflight > 0)
+        pthread_cond_wait(&async_done, &async_lock);
+    pthread_mutex_unlock(&async_lock);
+}
+
+/*---------------------------------------------------------------*/
+/*Queues a block request, returns 0 or -1 if it cannot be queued */
+/*---------------------------------------------------------------*/
+static int submit_request(int write, int start_address, int nblocks, void *buffer, void *user_data)
+{
+    disk_t *disk = default_disk;
+    struct blk_iovec iov;
+    struct async_req *req;
+
+    if (disk == NULL || disk->fd == -1)
+    {
+        printf("disk is not initialized\n");
+        return -1;
+    }
+    iov.start_address = start_address;
+    iov.nblocks = nblocks;
+    iov.buffer = buffer;
+    if (check_blk_iovec(disk, &iov, 1) == -1)
+        return -1;
+
+    async_start();
+
+    req = (struct async_req*) malloc(sizeof(struct async_req));
+    if (req == NULL)
+        return -1;
+    req->disk = disk;
+    req->write = write;
+    req->start_address = start_address;
+    req->nblocks = nblocks;
+    req->buffer = (char*) buffer;
+    req->done = 0;
+    req->user_data = user_data;
+    req->submitted = clock_ns();
+    req->next = NULL;
+
+    pthread_mutex_lock(&async_lock);
+
+    /*A mapped image completes right away, there is nothing to wait for*/
+    if (disk->map != NULL)
+    {
+        async_inflight++;
+        req->result = transfer_blocks_v(disk, &iov, 1, write);
+        async_complete(req);
+        pthread_mutex_unlock(&async_lock);
+        return 0;
+    }
+
+#ifdef __linux__
+    /*The kernel knows neither the device model, the striping nor the cache, those requests go to the pool*/
+    if (use_uring && !model_active(disk) && disk->nmembers == 1 && disk->cache == NULL)
+    {
+        /*Keep the ring from overflowing*/
+        while (uring_inflight >= ASYNC_DEPTH)
+            uring_reap(1);
+        async_inflight++;
+        uring_inflight++;
+        stats_position(disk, start_address, nblocks);
+        uring_queue(req);
+        pthread_mutex_unlock(&async_lock);
+        return 0;
+    }
+#endif
+
+    async_grow_workers(disk);
+    while (async_inflight >= ASYNC_DEPTH)
+        pthread_cond_wait(&async_done, &async_lock);
+    async_inflight++;
+    if (pending_tail == NULL)
+        pending_head = req;
     else
-        return e;
+        pending_tail->next = req;
+    pending_tail = req;
+    pthread_cond_signal(&async_work);
+    pthread_mutex_unlock(&async_lock);
+    return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/*Starts reading nblocks blocks into buffer, which must stay valid   */
+/*until the request is returned by poll_completions                  */
+/*-------------------------------------------------------------------*/
+int submit_read(int start_address, int nblocks, void *buffer, void *user_data)
+{
+    return submit_request(0, start_address, nblocks, buffer, user_data);
+}
+
+/*-------------------------------------------------------------------*/
+/*Starts writing nblocks blocks from buffer, which must stay valid   */
+/*until the request is returned by poll_completions                  */
+/*-------------------------------------------------------------------*/
+int submit_write(int start_address, int nblocks, void *buffer, void *user_data)
+{
+    return submit_request(1, start_address, nblocks, buffer, user_data);
+}
+
+/*-------------------------------------------------------------------*/
+/*Returns up to max finished requests, waiting until at least        */
+/*min_complete are available or nothing is left in flight            */
+/*-------------------------------------------------------------------*/
+int poll_completions(struct blk_completion *completions, int max, int min_complete)
+{
+    struct async_req *req;
+    int n = 0;
+
+    if (async_pid != getpid())
+        return 0;
+    if (min_complete > max)
+        min_complete = max;
+
+    pthread_mutex_lock(&async_lock);
+#ifdef __linux__
+    if (use_uring)
+    {
+        uring_reap(0);
+        while (done_count < min_complete && uring_inflight > 0)
+            uring_reap(1);
+    }
+#endif
+    while (done_count < min_complete && async_inflight > 0)
+        pthread_cond_wait(&async_done, &async_lock);
+
+    while (n < max && done_head != NULL)
+    {
+        req = done_head;
+        done_head = req->next;
+        if (done_head == NULL)
+            done_tail = NULL;
+        done_count--;
+
+        completions[n].user_data = req->user_data;
+        completions[n].result = req->result;
+        n++;
+        free(req);
+    }
+    pthread_mutex_unlock(&async_lock);
+    return n;
 }
@@ -1,5 +1,103 @@
+/*Most image files a disk can be striped over, see disk_set_striping*/
+#define DISK_MAX_STRIPES 16
+
+/*An open disk, see disk_open*/
+typedef struct disk disk_t;
+
+/*Flags of disk_open*/
+#define DISK_OPEN_FRESH 1   /*create a new image filled with 0's*/
+#define DISK_OPEN_MMAP  2   /*serve blocks from a mapping of the image*/
+
+/*A range of contiguous blocks and the memory it is transferred to/from*/
+struct blk_iovec {
+    int start_address;
+    int nblocks;
+    void *buffer;
+};
+
+/*Durability modes, see disk_barrier*/
+enum disk_durability {
+    DISK_DURABILITY_NONE,
+    DISK_DURABILITY_FLUSH,
+    DISK_DURABILITY_FDATASYNC,
+    DISK_DURABILITY_DSYNC
+};
+
+/*Eviction policies of the buffer cache, see disk_set_cache*/
+enum disk_cache_policy {
+    DISK_CACHE_LRU,
+    DISK_CACHE_CLOCK
+};
+
+/*A finished asynchronous request, result as for read_blocks/write_blocks*/
+struct blk_completion {
+    void *user_data;
+    int result;
+};
+
+/*Cost model of the emulated device, see disk_set_model*/
+struct disk_model {
+    double latency_us;          /*base latency of every request*/
+    double seek_us_per_block;   /*added per block of distance from the previous request*/
+    double bandwidth_mbps;      /*transfer rate in MB/s, 0 for unlimited*/
+    int queue_depth;            /*requests serviced concurrently*/
+    double failure_p;           /*probability a transfer fails, 0 for never*/
+    int max_retry;              /*retries of a failed transfer before giving up*/
+};
+
+/*Latency histogram buckets: bucket 0 counts operations under 2 us, bucket i*/
+/*those that took [2^i, 2^(i+1)) us, the last one everything longer        */
+#define DISK_LAT_BUCKETS 24
+
+/*Counters of one kind of operation*/
+struct disk_op_stats {
+    unsigned long long calls;
+    unsigned long long blocks;          /*blocks transferred*/
+    unsigned long long errors;          /*calls that failed, in whole or in part*/
+    unsigned long long total_ns;
+    unsigned long long latency_hist[DISK_LAT_BUCKETS];
+};
+
+/*What has been done to a disk since it was opened or its stats reset, see disk_get_stats*/
+struct disk_stats {
+    struct disk_op_stats read;
+    struct disk_op_stats write;
+    struct disk_op_stats flush;         /*disk_sync/disk_barrier*/
+    unsigned long long seeks;           /*transfers not starting where the previous one ended*/
+    unsigned long long cache_hits;      /*blocks served by the buffer cache*/
+    unsigned long long cache_misses;    /*blocks the buffer cache had to read*/
+    unsigned long long cache_writebacks; /*dirty blocks written back*/
+    unsigned long long bytes_copied;    /*block data copied: by pread/pwrite, to/from the mapping or the cache*/
+};
+
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
+int read_blocks_v(const struct blk_iovec *iov, int n);
+int write_blocks_v(const struct blk_iovec *iov, int n);
 int close_disk();
+int init_fresh_disk_mmap(char *filename, int block_size, int num_blocks);
+int init_disk_mmap(char *filename, int block_size, int num_blocks);
+void *disk_block_ptr(int address);
+int disk_set_durability(int mode);
+int disk_barrier();
+int submit_read(int start_address, int nblocks, void *buffer, void *user_data);
+int submit_write(int start_address, int nblocks, void *buffer, void *user_data);
+int poll_completions(struct blk_completion *completions, int max, int min_complete);
+int disk_model_preset(const char *name, struct disk_model *model);
+int disk_set_model(const struct disk_model *model);
+int disk_set_striping(int members, int stripe_unit);
+int disk_set_eager_zero(int eager);
+disk_t *disk_open(char *filename, int block_size, int num_blocks, int flags);
+int disk_read(disk_t *disk, int start_address, int nblocks, void *buffer);
+int disk_write(disk_t *disk, int start_address, int nblocks, void *buffer);
+int disk_read_v(disk_t *disk, const struct blk_iovec *iov, int n);
+int disk_write_v(disk_t *disk, const struct blk_iovec *iov, int n);
+int disk_sync(disk_t *disk);
+int disk_close(disk_t *disk);
+int disk_get_stats(disk_t *disk, struct disk_stats *stats);
+int disk_reset_stats(disk_t *disk);
+int disk_set_cache(int capacity_blocks, int policy);
+int disk_flush(disk_t *disk);
+int flush_blocks();
@@ -1,19 +1,40 @@
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include "sfs_api.h"
 #include "disk_emu.h"
 
 
-//////////////////////////
-// I-Node/J-Node Struct //
-//////////////////////////
+// Direct pointers of an i-node
+#define NB_DIRECT_PTRS 12
+// Blocks of the i-node file, the direct pointers of the j-node
+#define NB_INODE_BLOCKS 13
+
+///////////////////
+// I-Node Struct //
+///////////////////
 typedef struct {
-	int size;
-	int direct_ptr[14];
-	int indirectPtr;	
+	// Size in bytes, 64 bits so files can grow past 2 GiB
+	long long size;
+	int direct_ptr[NB_DIRECT_PTRS];
+	// Pointer block mapping the blocks that follow the direct ones
+	int indirectPtr;
+	// Pointer block of pointer blocks mapping the blocks that follow those of indirectPtr
+	int doubleIndirectPtr;
 } Node;
 
+///////////////////
+// J-Node Struct //
+///////////////////
+// Same 16 ints as an i-node. The i-node file is at most NB_INODE_BLOCKS blocks, so its size fits an int
+typedef struct {
+	int size;
+	int direct_ptr[NB_INODE_BLOCKS];
+	int indirectPtr;
+	int doubleIndirectPtr;
+} Jnode;
+
 ////////////////////////////
 // Directory Entry Struct //
 ////////////////////////////
@@ -27,8 +48,8 @@ typedef struct {
 //////////////////////////////////////
 typedef struct {
 	int inode_nb;
-	int read_ptr;
-	int write_ptr;
+	long long read_ptr;
+	long long write_ptr;
 } Fd_entry;
 
 ///////////////////////////////
@@ -37,24 +58,58 @@ typedef struct {
 
 // Disk Name
 char* DISK_NAME = "260637833_ssfs";
-// Block Size
-const int SIZE_BLOCK = 1024;
-// Number of Data Blocks
-const int NUMBER_DATA_BLOCKS = 1024;
-// Number of Data Blocks + Super Block, FBM, and VM
-const int FILE_SYSTEM_SIZE = 1027;
+// Super Block magic entry, the low bits are the format version
+const unsigned int SB_MAGIC = 0xACBD0009;
+// Format version 5, converted at mount (see upgrade_format)
+const unsigned int SB_MAGIC_V5 = 0xACBD0005;
+// Super Block int where the layout starts, right after the root j-node, and its number of ints (see store_layout)
+const int SB_LAYOUT_OFFSET = 4 + sizeof(Jnode)/sizeof(int);
+const int SB_LAYOUT_FIELDS = 6;
 // Starting address of Super Block
 const int SB_STARTING_ADDRESS = 0;
 // Starting address of Data Blocks
 const int DB_STARTING_ADDRESS = 1;
-// Starting address of Free Bit Map
-const int FBM_STARTING_ADDRESS = 1025;
 
+// Geometry of the disks made by mkssfs(1)
+const int DEFAULT_SIZE_BLOCK = 1024;
+const int DEFAULT_FILE_SYSTEM_SIZE = 1027;
+const int DEFAULT_NUMBER_INODES = 200;
+// Block sizes mkssfs_ex accepts (powers of 2)
+const int MIN_SIZE_BLOCK = 1024;
+const int MAX_SIZE_BLOCK = 65536;
+
+////////////////////////////////////////////////////////////
+// Layout of the mounted disk, see set_layout. Formatting //
+// records it in the super block, mounting reads it back  //
+////////////////////////////////////////////////////////////
+
+// Block Size
+int SIZE_BLOCK = 1024;
+// Number of Data Blocks
+int NUMBER_DATA_BLOCKS = 1024;
+// Number of Data Blocks + Super Block, FBM, and VM
+int FILE_SYSTEM_SIZE = 1027;
+// Starting address of Free Bit Map
+int FBM_STARTING_ADDRESS = 1025;
+// Blocks of the Free Bit Map, one bit per data block
+int FBM_BLOCKS = 1;
 // Starting address of Write Mask
-const int WM_STARTING_ADDRESS = 1026;
+int WM_STARTING_ADDRESS = 1026;
+// Blocks of the Write Mask, one byte per data block
+int WM_BLOCKS = 1;
+// Blocks of the root directory, the last data blocks
+int DIRECTORY_BLOCKS = 4;
+// Maximum files, the i-nodes minus the root directory's
+int MAX_FILES = 199;
+
+// Entries of the open file descriptor table at mount, it doubles whenever it is full
+const int FD_TABLE_INITIAL_SIZE = 16;
 
-// Maximum i-nodes
-const int MAX_FILES = 199;
+// Durability mode the disk is mounted with (see disk_barrier in disk_emu.c)
+static int DURABILITY_MODE = DISK_DURABILITY_FLUSH;
+
+// Blocks kept in the disk buffer cache (see disk_set_cache in disk_emu.c)
+static int CACHE_BLOCKS = 64;
 
 
 /////////////////////
@@ -63,47 +118,269 @@ const int MAX_FILES = 199;
 
 // Root Directory Cache
 Directory_entry* root_dir_cache;
-// FBM Cache
-char* fbm_cache;
+// Root Directory Index: open addressing hash table from filename to root directory slot (-1 = empty)
+int* dir_index;
+int dir_index_size;
+// Free root directory slots, lowest slot on top
+int* dir_free_slots;
+int dir_free_count;
+// Data blocks of the root directory, copied from the 0th i-node
+int dir_block_ptr[NB_DIRECT_PTRS];
+// Blocks of the root directory cache modified since they were last written back
+char dir_block_dirty[NB_DIRECT_PTRS];
+// FBM Cache: one bit per data block (1 = used, 0 = unused), bits past the last data block are set
+uint64_t* fbm_cache;
+// Word of the FBM the next search for an empty data block starts from
+int fbm_hint;
+// Blocks of the FBM cache changed since they were last written back
+char* fbm_dirty;
 // Root JNode Cache
-Node* root_jnode;
+Jnode* root_jnode;
+// I-Node Cache: the blocks of the i-node file, in root j-node pointer order, so i-node n is inode_cache[n]
+Node* inode_cache;
+// Blocks of the i-node cache modified since they were last written back
+char inode_block_dirty[NB_INODE_BLOCKS];
+// Free i-nodes of the allocated i-node blocks, lowest number on top. Rebuilt at mount from the i-node cache
+int* inode_free_list;
+int inode_free_count;
+// Pointer Block Cache: pointer blocks of the files' block maps, indexed by data block, loaded on first use
+int** ptr_block_cache;
+// Pointer blocks modified since they were last written back
+char* ptr_block_dirty;
+int* ptr_dirty_list;
+int ptr_dirty_count;
+// Data blocks the pointer block cache was set up for
+int ptr_block_cache_size;
 
 /* SHADOW
 // WM Cache
 */
 
-// Open File Descriptor Table
-// SIZE MUST MATCH MAX_FILES
-Fd_entry Open_Fd_Table[199];
+// Open File Descriptor Table, grows when every entry is in use
+Fd_entry* Open_Fd_Table;
+int fd_table_size;
+// Free file descriptors, lowest on top
+int* fd_free_stack;
+int fd_free_count;
+// File descriptor each i-node is open under, -1 if it is not open
+int* inode_fd_map;
+
+/*
+/ Blocks taken by the file system with the given number of data blocks: super block, data blocks, FBM and WM
+*/
+int layout_size(int data_blocks, int block_size) {
+	int fbm_blocks = (data_blocks + block_size*8 - 1) / (block_size*8);
+	int wm_blocks = (data_blocks + block_size - 1) / block_size;
+	return 1 + data_blocks + fbm_blocks + wm_blocks;
+}
+
+/*
+/ Derive the layout of a disk from its geometry: the data blocks follow the super block, then come the FBM (one bit
+/ per data block) and the WM (one byte per data block). The root directory takes the last data blocks.
+/ Returns -1 if the geometry can't hold a file system, leaving the layout as it was
+*/
+int set_layout(int block_size, int fs_size, int nb_inodes) {
+	if (block_size < MIN_SIZE_BLOCK || block_size > MAX_SIZE_BLOCK || (block_size & (block_size-1)) != 0) {
+		printf("Error: Block size must be a power of 2 from %d to %d\n", MIN_SIZE_BLOCK, MAX_SIZE_BLOCK);
+		return -1;
+	}
+	// The i-node file is made of the root j-node's direct pointers
+	int max_inodes = NB_INODE_BLOCKS*(block_size/sizeof(Node));
+	if (nb_inodes < 2 || nb_inodes > max_inodes) {
+		printf("Error: Number of i-nodes must be from 2 to %d\n", max_inodes);
+		return -1;
+	}
+	int dir_blocks = ((nb_inodes-1)*sizeof(Directory_entry) + block_size - 1) / block_size;
+
+	// Most data blocks that fit with their FBM and WM
+	int data_blocks = fs_size - 1;
+	while (data_blocks > 0 && layout_size(data_blocks, block_size) > fs_size) {
+		data_blocks = fs_size - (layout_size(data_blocks, block_size) - data_blocks);
+	}
+	while (data_blocks > 0 && layout_size(data_blocks + 1, block_size) <= fs_size) {
+		data_blocks++;
+	}
+	// Room for the first i-node block and the root directory
+	if (data_blocks < dir_blocks + 1) {
+		printf("Error: File system size too small\n");
+		return -1;
+	}
+
+	SIZE_BLOCK = block_size;
+	FILE_SYSTEM_SIZE = fs_size;
+	NUMBER_DATA_BLOCKS = data_blocks;
+	FBM_STARTING_ADDRESS = DB_STARTING_ADDRESS + data_blocks;
+	FBM_BLOCKS = (data_blocks + block_size*8 - 1) / (block_size*8);
+	WM_STARTING_ADDRESS = FBM_STARTING_ADDRESS + FBM_BLOCKS;
+	WM_BLOCKS = (data_blocks + block_size - 1) / block_size;
+	DIRECTORY_BLOCKS = dir_blocks;
+	MAX_FILES = nb_inodes - 1;
+	return 0;
+}
+
+/*
+/ Record the layout in the super block, after the root j-node
+*/
+void store_layout(int* sb_int_ptr) {
+	sb_int_ptr[SB_LAYOUT_OFFSET] = NUMBER_DATA_BLOCKS;
+	sb_int_ptr[SB_LAYOUT_OFFSET+1] = FBM_STARTING_ADDRESS;
+	sb_int_ptr[SB_LAYOUT_OFFSET+2] = FBM_BLOCKS;
+	sb_int_ptr[SB_LAYOUT_OFFSET+3] = WM_STARTING_ADDRESS;
+	sb_int_ptr[SB_LAYOUT_OFFSET+4] = WM_BLOCKS;
+	sb_int_ptr[SB_LAYOUT_OFFSET+5] = DIRECTORY_BLOCKS;
+}
+
+/*
+/ Open the existing disk with the geometry and layout recorded in its super block. Format version 5 disks have the
+/ default geometry. Returns -1 if the disk can't be opened
+*/
+int init_disk_layout() {
+	// Open with the smallest block size to read the start of the super block
+	if (init_disk(DISK_NAME, MIN_SIZE_BLOCK, 1) == -1) {
+		printf("Error: init_disk returned -1\n");
+		return -1;
+	}
+	int* sb_int_ptr = (int*) malloc(MIN_SIZE_BLOCK);
+	read_blocks(SB_STARTING_ADDRESS, 1, sb_int_ptr);
+	if ((unsigned int) sb_int_ptr[0] == SB_MAGIC) {
+		SIZE_BLOCK = sb_int_ptr[1];
+		FILE_SYSTEM_SIZE = sb_int_ptr[2];
+		MAX_FILES = sb_int_ptr[3] - 1;
+		NUMBER_DATA_BLOCKS = sb_int_ptr[SB_LAYOUT_OFFSET];
+		FBM_STARTING_ADDRESS = sb_int_ptr[SB_LAYOUT_OFFSET+1];
+		FBM_BLOCKS = sb_int_ptr[SB_LAYOUT_OFFSET+2];
+		WM_STARTING_ADDRESS = sb_int_ptr[SB_LAYOUT_OFFSET+3];
+		WM_BLOCKS = sb_int_ptr[SB_LAYOUT_OFFSET+4];
+		DIRECTORY_BLOCKS = sb_int_ptr[SB_LAYOUT_OFFSET+5];
+	}
+	else if ((unsigned int) sb_int_ptr[0] == SB_MAGIC_V5) {
+		set_layout(DEFAULT_SIZE_BLOCK, DEFAULT_FILE_SYSTEM_SIZE, DEFAULT_NUMBER_INODES);
+	}
+	else {
+		printf("Error: Unknown disk format\n");
+		free(sb_int_ptr);
+		return -1;
+	}
+	free(sb_int_ptr);
+
+	if (init_disk(DISK_NAME, SIZE_BLOCK, FILE_SYSTEM_SIZE) == -1) {
+		printf("Error: init_disk returned -1\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+/ Drop the caches of the file system mounted before, the next one may have another geometry
+*/
+void release_caches() {
+	free(root_jnode);
+	root_jnode = NULL;
+	free(inode_cache);
+	inode_cache = NULL;
+	free(inode_free_list);
+	inode_free_list = NULL;
+	free(root_dir_cache);
+	root_dir_cache = NULL;
+	free(fbm_cache);
+	fbm_cache = NULL;
+	free(fbm_dirty);
+	fbm_dirty = NULL;
+}
 
 /*
 / Initialize root j-node in cache
 */
-Node* getRootJNode() {
+Jnode* getRootJNode() {
 	if (root_jnode == NULL) {
 		// Get root j node from disk
 		int* sb_int_ptr = (int*) malloc(SIZE_BLOCK);
 		read_blocks(SB_STARTING_ADDRESS, 1, sb_int_ptr);
 
 		// Store root j node in cache
-		root_jnode = (Node*) malloc(sizeof(Node));
-		memcpy(root_jnode, &(sb_int_ptr[4]), sizeof(Node));
+		root_jnode = (Jnode*) malloc(sizeof(Jnode));
+		memcpy(root_jnode, &(sb_int_ptr[4]), sizeof(Jnode));
 		free(sb_int_ptr);
 	}
 	return root_jnode;
 }
 
 /*
-/ Update Super block in memory whenever you make changes to root j-node
+/ Initialize the i-node cache by reading every allocated block of the i-node file
 */
-void updateSB() {
-	// Get root j-node
-	int* sb_int_ptr = (int*) malloc(SIZE_BLOCK);
-	read_blocks(SB_STARTING_ADDRESS, 1, sb_int_ptr);
-	// Overwrite previous root jnode
-	memcpy(&(sb_int_ptr[4]),root_jnode, sizeof(Node));
-	write_blocks(SB_STARTING_ADDRESS, 1, sb_int_ptr);
-	free(sb_int_ptr);	
+void initialize_inode_cache() {
+	if (inode_cache == NULL) {
+		inode_cache = (Node*) malloc(SIZE_BLOCK*NB_INODE_BLOCKS);
+	}
+	// Look for root j-node
+	if (root_jnode == NULL) {
+		getRootJNode();
+	}
+	struct blk_iovec inode_iov[NB_INODE_BLOCKS];
+	int nb_blocks = 0;
+	for (int i=0; i<NB_INODE_BLOCKS; i++) {
+		inode_block_dirty[i] = 0;
+		if ((*root_jnode).direct_ptr[i] > -1) {
+			inode_iov[nb_blocks].start_address = DB_STARTING_ADDRESS + (*root_jnode).direct_ptr[i];
+			inode_iov[nb_blocks].nblocks = 1;
+			inode_iov[nb_blocks].buffer = &(inode_cache[i*SIZE_BLOCK/sizeof(Node)]);
+			nb_blocks++;
+		}
+	}
+	// Single submission for all i-node blocks
+	if (nb_blocks > 0) {
+		read_blocks_v(inode_iov, nb_blocks);
+	}
+
+	// Free i-node list, walking down so the lowest free i-node ends on top
+	if (inode_free_list == NULL) {
+		inode_free_list = (int*) malloc(NB_INODE_BLOCKS*SIZE_BLOCK/sizeof(Node)*sizeof(int));
+	}
+	inode_free_count = 0;
+	for (int i=MAX_FILES; i>=0; i--) {
+		if ((*root_jnode).direct_ptr[i/(SIZE_BLOCK/sizeof(Node))] > -1 && inode_cache[i].size == -1) {
+			inode_free_list[inode_free_count++] = i;
+		}
+	}
+}
+
+/*
+/ Return the cached i-node with the given number, NULL if its i-node block is not allocated
+*/
+Node* get_inode(int inode_nb) {
+	int direct_ptr_nb = inode_nb/(SIZE_BLOCK/sizeof(Node));
+	if (inode_nb < 0 || direct_ptr_nb >= NB_INODE_BLOCKS || (*root_jnode).direct_ptr[direct_ptr_nb] == -1) {
+		return NULL;
+	}
+	return &(inode_cache[inode_nb]);
+}
+
+/*
+/ Mark the block holding an i-node as modified, so write_back_inodes saves it
+*/
+void mark_inode_dirty(int inode_nb) {
+	inode_block_dirty[inode_nb/(SIZE_BLOCK/sizeof(Node))] = 1;
+}
+
+/*
+/ Write the modified blocks of the i-node cache back to disk
+*/
+int write_back_inodes() {
+	struct blk_iovec inode_iov[NB_INODE_BLOCKS];
+	int nb_blocks = 0;
+	for (int i=0; i<NB_INODE_BLOCKS; i++) {
+		if (inode_block_dirty[i] && (*root_jnode).direct_ptr[i] > -1) {
+			inode_iov[nb_blocks].start_address = DB_STARTING_ADDRESS + (*root_jnode).direct_ptr[i];
+			inode_iov[nb_blocks].nblocks = 1;
+			inode_iov[nb_blocks].buffer = &(inode_cache[i*SIZE_BLOCK/sizeof(Node)]);
+			nb_blocks++;
+		}
+		inode_block_dirty[i] = 0;
+	}
+	if (nb_blocks == 0) {
+		return 0;
+	}
+	return write_blocks_v(inode_iov, nb_blocks);
 }
 
 /*
@@ -111,25 +388,133 @@ void updateSB() {
 */
 void initialize_directory_cache() {	
 	if (root_dir_cache == NULL) {
-		root_dir_cache = (Directory_entry*) malloc(SIZE_BLOCK*4);
+		root_dir_cache = (Directory_entry*) malloc(SIZE_BLOCK*DIRECTORY_BLOCKS);
 	}
-	Node* initial_inode = (Node*) malloc(SIZE_BLOCK);
+	// Get 0th i-node to get root directory, from the i-node cache
+	Node* initial_inode = get_inode(0);
 
-	// Look for root j-node
-	if (root_jnode == NULL) {
-		getRootJNode();
+	// Read root directory blocks into cache from the 0th inode first pointers
+	// Note: 0th i-node always points to root directory
+	struct blk_iovec dir_iov[NB_DIRECT_PTRS];
+	for (int i=0; i<DIRECTORY_BLOCKS; i++) {
+		dir_block_ptr[i] = (*initial_inode).direct_ptr[i];
+		dir_block_dirty[i] = 0;
+		dir_iov[i].start_address = DB_STARTING_ADDRESS + dir_block_ptr[i];
+		dir_iov[i].nblocks = 1;
+		dir_iov[i].buffer = &(root_dir_cache[i*SIZE_BLOCK/sizeof(Directory_entry)]);
+	}
+	// Single submission for all the blocks
+	read_blocks_v(dir_iov, DIRECTORY_BLOCKS);
+}
+
+/*
+/ Mark the block holding a root directory slot as modified, so update_directory_disk saves it
+*/
+void mark_directory_dirty(int slot) {
+	dir_block_dirty[slot/(SIZE_BLOCK/sizeof(Directory_entry))] = 1;
+}
+
+/*
+/ Hash of a filename (FNV-1a), used to index the root directory
+*/
+unsigned int hash_filename(char* name) {
+	unsigned int hash = 2166136261u;
+	for (int i=0; i<10 && name[i] != '\0'; i++) {
+		hash ^= (unsigned char) name[i];
+		hash *= 16777619u;
 	}
-	// Get 0th i-node to get root directory 
-	read_blocks(DB_STARTING_ADDRESS + root_jnode[0].direct_ptr[0], 1, initial_inode);
+	return hash;
+}
 
-	// Read root directory blocks into cache from the 0th inode first 4 pointers
-	// Note: 0th i-node always points to root directory
-	read_blocks(DB_STARTING_ADDRESS + initial_inode[0].direct_ptr[0], 1, &(root_dir_cache[0]));
-	read_blocks(DB_STARTING_ADDRESS + initial_inode[0].direct_ptr[1], 1, &(root_dir_cache[SIZE_BLOCK/sizeof(Directory_entry)]));
-	read_blocks(DB_STARTING_ADDRESS + initial_inode[0].direct_ptr[2], 1, &(root_dir_cache[2*SIZE_BLOCK/sizeof(Directory_entry)]));
-	read_blocks(DB_STARTING_ADDRESS + initial_inode[0].direct_ptr[3], 1, &(root_dir_cache[3*SIZE_BLOCK/sizeof(Directory_entry)]));
+/*
+/ Return the root directory slot holding the given filename, -1 if there is none
+*/
+int find_directory_entry(char* name) {
+	unsigned int mask = dir_index_size - 1;
+	for (unsigned int i = hash_filename(name) & mask; dir_index[i] != -1; i = (i+1) & mask) {
+		if (strcmp(name, root_dir_cache[dir_index[i]].filename) == 0) {
+			return dir_index[i];
+		}
+	}
+	return -1;
+}
 
-	free(initial_inode);
+/*
+/ Add a root directory slot to the index, under the filename it holds
+*/
+void index_directory_entry(int slot) {
+	unsigned int mask = dir_index_size - 1;
+	unsigned int i = hash_filename(root_dir_cache[slot].filename) & mask;
+	while (dir_index[i] != -1) {
+		i = (i+1) & mask;
+	}
+	dir_index[i] = slot;
+}
+
+/*
+/ Remove a root directory slot from the index. Must be called while the slot still holds its filename
+*/
+void unindex_directory_entry(int slot) {
+	unsigned int mask = dir_index_size - 1;
+	unsigned int i = hash_filename(root_dir_cache[slot].filename) & mask;
+	while (dir_index[i] != slot) {
+		if (dir_index[i] == -1) {
+			return;
+		}
+		i = (i+1) & mask;
+	}
+	// Shift back the entries that follow, so no probe sequence is broken by the hole
+	unsigned int j = i;
+	while (1) {
+		j = (j+1) & mask;
+		if (dir_index[j] == -1) {
+			break;
+		}
+		unsigned int home = hash_filename(root_dir_cache[dir_index[j]].filename) & mask;
+		// Entry at j may move to the hole at i unless its home lies cyclically in (i, j]
+		if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+			dir_index[i] = dir_index[j];
+			i = j;
+		}
+	}
+	dir_index[i] = -1;
+}
+
+/*
+/ Build the root directory index and the free slot list from the root directory cache
+*/
+void initialize_directory_index() {
+	// At most half full
+	dir_index_size = 1;
+	while (dir_index_size < 2*MAX_FILES) {
+		dir_index_size *= 2;
+	}
+	free(dir_index);
+	free(dir_free_slots);
+	dir_index = (int*) malloc(dir_index_size*sizeof(int));
+	dir_free_slots = (int*) malloc(MAX_FILES*sizeof(int));
+	for (int i=0; i<dir_index_size; i++) {
+		dir_index[i] = -1;
+	}
+	dir_free_count = 0;
+	// Walk down so the lowest free slot ends on top of the stack
+	for (int i=MAX_FILES-1; i>=0; i--) {
+		if (strcmp(root_dir_cache[i].filename, "") == 0) {
+			dir_free_slots[dir_free_count++] = i;
+		}
+		else {
+			index_directory_entry(i);
+		}
+	}
+}
+
+/*
+/ Mark the bits of the FBM cache past the last data block as used, so they are never allocated
+*/
+void mask_fbm_tail() {
+	for (int i=NUMBER_DATA_BLOCKS; i<FBM_BLOCKS*SIZE_BLOCK*8; i++) {
+		fbm_cache[i/64] |= (uint64_t) 1 << (i%64);
+	}
 }
 
 /*
@@ -137,9 +522,217 @@ void initialize_directory_cache() {
 */
 void initialize_fbm_cache() {
 	if (fbm_cache == NULL) {
-		fbm_cache = (char*) malloc(SIZE_BLOCK);
+		fbm_cache = (uint64_t*) malloc(FBM_BLOCKS*SIZE_BLOCK);
 	}
-	read_blocks(FBM_STARTING_ADDRESS, 1, fbm_cache);
+	if (fbm_dirty == NULL) {
+		fbm_dirty = (char*) malloc(FBM_BLOCKS);
+	}
+	read_blocks(FBM_STARTING_ADDRESS, FBM_BLOCKS, fbm_cache);
+	mask_fbm_tail();
+	fbm_hint = 0;
+	memset(fbm_dirty, 0, FBM_BLOCKS);
+}
+
+/*
+/ Convert a format version 5 disk in place. It has the default geometry and no layout in the super block. Its i-nodes
+/ and root j-node are 16 ints: a 32-bit size, 14 direct pointers, then indirectPtr, the number of a chained i-node whose
+/ direct pointers hold blocks 14 to 27 of the file. The blocks past the 12 direct pointers move to a single indirect
+/ pointer block and the chained i-nodes are freed, as are the i-nodes no directory entry reaches. The FBM, one byte per
+/ data block, is rebuilt from the blocks the files reach, since version 5 could mark freed blocks used and the reverse.
+/ Returns -1 if the disk can't be converted, leaving it as it was
+*/
+int upgrade_format() {
+	int* sb_int_ptr = (int*) malloc(SIZE_BLOCK);
+	read_blocks(SB_STARTING_ADDRESS, 1, sb_int_ptr);
+	if ((unsigned int) sb_int_ptr[0] != SB_MAGIC_V5) {
+		free(sb_int_ptr);
+		return 0;
+	}
+	int ints_per_node = sizeof(Node)/sizeof(int);
+	int nodes_per_block = SIZE_BLOCK/sizeof(Node);
+	int nb_inodes = 14*nodes_per_block;
+	// Blocks of a version 5 file: 14 direct ones, then 14 in the chained i-node
+	int max_blocks = 2*14;
+	int* jnode = &(sb_int_ptr[4]);
+	int res = 0;
+
+	// Read the whole version 5 i-node file, missing blocks read as free i-nodes
+	int* inodes = (int*) malloc(14*SIZE_BLOCK);
+	for (int i=0; i<14; i++) {
+		if (jnode[1+i] > -1 && jnode[1+i] < NUMBER_DATA_BLOCKS) {
+			read_blocks(DB_STARTING_ADDRESS + jnode[1+i], 1, &(inodes[i*nodes_per_block*ints_per_node]));
+		}
+		else {
+			memset(&(inodes[i*nodes_per_block*ints_per_node]), 0xFF, SIZE_BLOCK);
+			if (jnode[1+i] >= NUMBER_DATA_BLOCKS) {
+				res = -1;
+			}
+		}
+	}
+
+	// The files are the i-nodes of the root directory entries, and the root directory's 0th i-node
+	char* is_file = (char*) calloc(nb_inodes, 1);
+	Directory_entry* dir = (Directory_entry*) malloc(DIRECTORY_BLOCKS*SIZE_BLOCK);
+	is_file[0] = 1;
+	if (inodes[0] == -1) {
+		res = -1;
+	}
+	for (int i=0; i<DIRECTORY_BLOCKS && res == 0; i++) {
+		int block_nb = inodes[1+i];
+		if (block_nb < 0 || block_nb >= NUMBER_DATA_BLOCKS) {
+			res = -1;
+			break;
+		}
+		read_blocks(DB_STARTING_ADDRESS + block_nb, 1, &(dir[i*SIZE_BLOCK/sizeof(Directory_entry)]));
+	}
+	for (int i=0; i<MAX_FILES && res == 0; i++) {
+		if (strcmp(dir[i].filename, "") == 0) {
+			continue;
+		}
+		// The i-node file keeps only the blocks the root j-node has direct pointers for
+		if (dir[i].inode_nb < 1 || dir[i].inode_nb >= NB_INODE_BLOCKS*nodes_per_block || inodes[dir[i].inode_nb*ints_per_node] == -1) {
+			res = -1;
+			break;
+		}
+		is_file[dir[i].inode_nb] = 1;
+	}
+
+	// Block maps of the files, version 5 block b of a file is block b here, and the new FBM. The 14th block of the
+	// i-node file only holds free or chained i-nodes, so it is dropped
+	int* file_blocks = (int*) malloc(nb_inodes*max_blocks*sizeof(int));
+	uint64_t* fbm = (uint64_t*) calloc(FBM_BLOCKS, SIZE_BLOCK);
+	for (int i=0; i<NB_INODE_BLOCKS; i++) {
+		if (jnode[1+i] > -1) {
+			fbm[jnode[1+i]/64] |= (uint64_t) 1 << (jnode[1+i]%64);
+		}
+	}
+	for (int i=0; i<nb_inodes && res == 0; i++) {
+		if (!is_file[i]) {
+			continue;
+		}
+		int* node = &(inodes[i*ints_per_node]);
+		int* blocks = &(file_blocks[i*max_blocks]);
+		int chained_nb = node[15];
+		for (int k=0; k<14; k++) {
+			blocks[k] = node[1+k];
+			blocks[14+k] = -1;
+		}
+		if (chained_nb > 0 && chained_nb < nb_inodes && !is_file[chained_nb] && inodes[chained_nb*ints_per_node] != -1) {
+			int* chained = &(inodes[chained_nb*ints_per_node]);
+			for (int k=0; k<14; k++) {
+				blocks[14+k] = chained[1+k];
+			}
+			// Version 5 sized the chained i-node with the end of the file's last write
+			if (chained[0] > node[0]) {
+				node[0] = chained[0];
+			}
+		}
+		for (int k=0; k<max_blocks; k++) {
+			if (blocks[k] >= NUMBER_DATA_BLOCKS) {
+				res = -1;
+			}
+			else if (blocks[k] > -1) {
+				fbm[blocks[k]/64] |= (uint64_t) 1 << (blocks[k]%64);
+			}
+		}
+	}
+	// A pointer block for each file with blocks past the direct ones
+	int* indirect_block = (int*) malloc(nb_inodes*sizeof(int));
+	for (int i=0; i<nb_inodes; i++) {
+		indirect_block[i] = -1;
+	}
+	int next_free = 0;
+	for (int i=0; i<nb_inodes && res == 0; i++) {
+		if (!is_file[i]) {
+			continue;
+		}
+		int indirect = 0;
+		for (int k=NB_DIRECT_PTRS; k<max_blocks; k++) {
+			indirect |= file_blocks[i*max_blocks + k] != -1;
+		}
+		if (!indirect) {
+			continue;
+		}
+		while (next_free < NUMBER_DATA_BLOCKS && ((fbm[next_free/64] >> (next_free%64)) & 1)) {
+			next_free++;
+		}
+		if (next_free == NUMBER_DATA_BLOCKS) {
+			res = -1;
+			break;
+		}
+		indirect_block[i] = next_free;
+		fbm[next_free/64] |= (uint64_t) 1 << (next_free%64);
+	}
+	if (res == -1) {
+		printf("Error: Disk can't be converted from format version 5\n");
+		free(indirect_block);
+		free(fbm);
+		free(file_blocks);
+		free(dir);
+		free(is_file);
+		free(inodes);
+		free(sb_int_ptr);
+		return -1;
+	}
+
+	// Write the pointer blocks, then the converted i-node file
+	Node* new_inodes = (Node*) malloc(NB_INODE_BLOCKS*SIZE_BLOCK);
+	int* ptr_block = (int*) malloc(SIZE_BLOCK);
+	memset(new_inodes, 0xFF, NB_INODE_BLOCKS*SIZE_BLOCK);
+	for (int i=0; i<NB_INODE_BLOCKS*nodes_per_block; i++) {
+		if (!is_file[i]) {
+			continue;
+		}
+		int* blocks = &(file_blocks[i*max_blocks]);
+		new_inodes[i].size = inodes[i*ints_per_node];
+		for (int k=0; k<NB_DIRECT_PTRS; k++) {
+			new_inodes[i].direct_ptr[k] = blocks[k];
+		}
+		if (indirect_block[i] > -1) {
+			for (int k=0; k<SIZE_BLOCK/sizeof(int); k++) {
+				ptr_block[k] = (NB_DIRECT_PTRS+k < max_blocks) ? blocks[NB_DIRECT_PTRS+k] : -1;
+			}
+			write_blocks(DB_STARTING_ADDRESS + indirect_block[i], 1, ptr_block);
+			new_inodes[i].indirectPtr = indirect_block[i];
+		}
+	}
+	Jnode root;
+	root.size = 0;
+	for (int i=0; i<NB_INODE_BLOCKS; i++) {
+		root.direct_ptr[i] = jnode[1+i];
+		if (root.direct_ptr[i] > -1) {
+			root.size += SIZE_BLOCK;
+			write_blocks(DB_STARTING_ADDRESS + root.direct_ptr[i], 1, &(new_inodes[i*nodes_per_block]));
+		}
+	}
+	root.indirectPtr = -1;
+	root.doubleIndirectPtr = -1;
+	write_blocks(FBM_STARTING_ADDRESS, FBM_BLOCKS, fbm);
+	// Converted i-nodes and FBM must be on disk before the super block says so
+	disk_barrier();
+	sb_int_ptr[0] = SB_MAGIC;
+	memcpy(jnode, &root, sizeof(Jnode));
+	// The layout takes the place of the first shadow root, which is unused
+	store_layout(sb_int_ptr);
+	write_blocks(SB_STARTING_ADDRESS, 1, sb_int_ptr);
+	disk_barrier();
+
+	free(ptr_block);
+	free(new_inodes);
+	free(indirect_block);
+	free(fbm);
+	free(file_blocks);
+	free(dir);
+	free(is_file);
+	free(inodes);
+	free(sb_int_ptr);
+	return 0;
+}
+/*
+/ Return whether a data block is used according to the fbm cache
+*/
+int fbm_block_used(int blocknb) {
+	return (fbm_cache[blocknb/64] >> (blocknb%64)) & 1;
 }
 
 /*
@@ -149,86 +742,214 @@ int modify_fbm(int blocknb, int newValue) {
 	if (fbm_cache == NULL) {
 		initialize_fbm_cache();
 	}
+	if (blocknb < 0 || blocknb >= NUMBER_DATA_BLOCKS) {
+		printf("Error: Data block number out of range\n");
+		return -1;
+	}
 	// Check if they are different values. If they are the same, that means that the block was already used/unused
-	if (fbm_cache[blocknb] == newValue) {
+	if (fbm_block_used(blocknb) == newValue) {
 		printf("Error: Can't modify as the block is already occupied/empty\n");
 		return -1;
 	}
 	else {
-		fbm_cache[blocknb] = newValue;
-		// Change fbm on disk
-		write_blocks(FBM_STARTING_ADDRESS, 1, fbm_cache);		
+		fbm_cache[blocknb/64] ^= (uint64_t) 1 << (blocknb%64);
+		// Change fbm on disk with the rest of the operation, see write_back_fbm
+		fbm_dirty[blocknb/(SIZE_BLOCK*8)] = 1;
+		return 0;
+	}
+}
+
+/*
+/ Write the blocks of the FBM cache that changed back to disk. All the FBM changes of an operation reach the disk in
+/ this one submission
+*/
+int write_back_fbm() {
+	if (fbm_dirty == NULL) {
+		return 0;
+	}
+	struct blk_iovec* fbm_iov = NULL;
+	int nb_blocks = 0;
+	for (int i=0; i<FBM_BLOCKS; i++) {
+		if (fbm_dirty[i]) {
+			if (fbm_iov == NULL) {
+				fbm_iov = (struct blk_iovec*) malloc(FBM_BLOCKS*sizeof(struct blk_iovec));
+			}
+			fbm_iov[nb_blocks].start_address = FBM_STARTING_ADDRESS + i;
+			fbm_iov[nb_blocks].nblocks = 1;
+			fbm_iov[nb_blocks].buffer = &(((char*) fbm_cache)[i*SIZE_BLOCK]);
+			nb_blocks++;
+			fbm_dirty[i] = 0;
+		}
+	}
+	if (nb_blocks == 0) {
 		return 0;
 	}
+	int res = write_blocks_v(fbm_iov, nb_blocks);
+	free(fbm_iov);
+	return res;
+}
+
+/*
+/ Update Super block in memory whenever you make changes to root j-node
+*/
+void updateSB() {
+	// Blocks the root j-node now points to are marked used on disk before it does
+	write_back_fbm();
+	// Get root j-node
+	int* sb_int_ptr = (int*) malloc(SIZE_BLOCK);
+	read_blocks(SB_STARTING_ADDRESS, 1, sb_int_ptr);
+	// Overwrite previous root jnode
+	memcpy(&(sb_int_ptr[4]),root_jnode, sizeof(Jnode));
+	write_blocks(SB_STARTING_ADDRESS, 1, sb_int_ptr);
+	free(sb_int_ptr);	
+	// Root j-node changes must reach the disk before anything that depends on them
+	disk_barrier();
+}
+
+/*
+/ Initialize the pointer block cache empty, pointer blocks are read when first used
+*/
+void initialize_ptr_block_cache() {
+	if (ptr_block_cache != NULL) {
+		for (int i=0; i<ptr_block_cache_size; i++) {
+			free(ptr_block_cache[i]);
+		}
+	}
+	free(ptr_block_cache);
+	free(ptr_block_dirty);
+	free(ptr_dirty_list);
+	ptr_block_cache_size = NUMBER_DATA_BLOCKS;
+	ptr_block_cache = (int**) calloc(NUMBER_DATA_BLOCKS, sizeof(int*));
+	ptr_block_dirty = (char*) calloc(NUMBER_DATA_BLOCKS, 1);
+	ptr_dirty_list = (int*) malloc(NUMBER_DATA_BLOCKS*sizeof(int));
+	ptr_dirty_count = 0;
+}
+
+/*
+/ Return the cached pointer block stored in data block blocknb, reading it on first use
+*/
+int* get_ptr_block(int blocknb) {
+	if (ptr_block_cache[blocknb] == NULL) {
+		ptr_block_cache[blocknb] = (int*) malloc(SIZE_BLOCK);
+		read_blocks(DB_STARTING_ADDRESS + blocknb, 1, ptr_block_cache[blocknb]);
+	}
+	return ptr_block_cache[blocknb];
+}
+
+/*
+/ Mark a cached pointer block as modified, so write_back_ptr_blocks saves it
+*/
+void mark_ptr_block_dirty(int blocknb) {
+	if (!ptr_block_dirty[blocknb]) {
+		ptr_block_dirty[blocknb] = 1;
+		ptr_dirty_list[ptr_dirty_count++] = blocknb;
+	}
+}
+
+/*
+/ Write the modified pointer blocks back to disk
+*/
+int write_back_ptr_blocks() {
+	if (ptr_dirty_count == 0) {
+		return 0;
+	}
+	struct blk_iovec* ptr_iov = (struct blk_iovec*) malloc(ptr_dirty_count*sizeof(struct blk_iovec));
+	int nb_blocks = 0;
+	for (int i=0; i<ptr_dirty_count; i++) {
+		int blocknb = ptr_dirty_list[i];
+		// Released since it was modified
+		if (!ptr_block_dirty[blocknb] || ptr_block_cache[blocknb] == NULL) {
+			continue;
+		}
+		ptr_iov[nb_blocks].start_address = DB_STARTING_ADDRESS + blocknb;
+		ptr_iov[nb_blocks].nblocks = 1;
+		ptr_iov[nb_blocks].buffer = ptr_block_cache[blocknb];
+		nb_blocks++;
+		ptr_block_dirty[blocknb] = 0;
+	}
+	ptr_dirty_count = 0;
+	int res = nb_blocks > 0 ? write_blocks_v(ptr_iov, nb_blocks) : 0;
+	free(ptr_iov);
+	return res;
+}
+
+/*
+/ End of an operation that changed the file system: write back the FBM and the i-nodes, then flush everything
+/ the operation left dirty in the disk cache. Once an ssfs_ call returns its metadata is on disk, a crash before
+/ that loses the changes it had not written back yet
+*/
+void sync_operation() {
+	write_back_fbm();
+	write_back_ptr_blocks();
+	write_back_inodes();
+	flush_blocks();
 }
 
 /*
 / Set a directory from scratch and save it in cache
 */ 
 void set_directory() {
-	Directory_entry* dir_buffer = (Directory_entry*) malloc(SIZE_BLOCK);
+	Directory_entry* dir_buffer = (Directory_entry*) malloc(DIRECTORY_BLOCKS*SIZE_BLOCK);
 	// Empty directory entry
 	Directory_entry dir_entry;
 	strcpy(dir_entry.filename, "");
 	dir_entry.inode_nb = -1;
+	// We can only have up to MAX_FILES files. Therefore, the rest of the entries are marked as unusable
+	Directory_entry unusable_entry;
+	strcpy(unusable_entry.filename, "UNUSABLE");
+	unusable_entry.inode_nb = 100000;
 	// Copy into buffer the empty directories
-	for (int i=0; i<SIZE_BLOCK/sizeof(Directory_entry); i++) {
-		memcpy(&(dir_buffer[i]), &dir_entry, sizeof(Directory_entry));
+	for (int i=0; i<DIRECTORY_BLOCKS*SIZE_BLOCK/sizeof(Directory_entry); i++) {
+		memcpy(&(dir_buffer[i]), i < MAX_FILES ? &dir_entry : &unusable_entry, sizeof(Directory_entry));
 	}
 	// Allocate into last data blocks, the root directory as shown in the picture of the assignment
-	write_blocks(DB_STARTING_ADDRESS + FBM_STARTING_ADDRESS-4-1, 1, dir_buffer);
-	write_blocks(DB_STARTING_ADDRESS + FBM_STARTING_ADDRESS-3-1, 1, dir_buffer);
-	write_blocks(DB_STARTING_ADDRESS + FBM_STARTING_ADDRESS-2-1, 1, dir_buffer);
-	// We can only have up to 199 files. Therefore, the rest of the entries are marked as unusable
-	strcpy(dir_entry.filename, "UNUSABLE");
-	dir_entry.inode_nb = 100000;
-	// Copying unusable directory entries into memory
-	for (int i=7; i<SIZE_BLOCK/sizeof(Directory_entry); i++) {
-		memcpy(&(dir_buffer[i]), &dir_entry, sizeof(Directory_entry));
-	}
-	write_blocks(DB_STARTING_ADDRESS + FBM_STARTING_ADDRESS-1-1, 1, dir_buffer);
+	write_blocks(DB_STARTING_ADDRESS + NUMBER_DATA_BLOCKS - DIRECTORY_BLOCKS, DIRECTORY_BLOCKS, dir_buffer);
 	free(dir_buffer);
 }
 
 /*
-/ FBM set up. Initialize each memory except the first one and the last 4 ones to unused data blocks
+/ FBM set up. Initialize each memory except the first one and the root directory's last ones to unused data blocks
 */
 void set_fbm() {
-	char* fbm_buffer = (char*) malloc(SIZE_BLOCK);
-	for (int i = 0; i < SIZE_BLOCK; i++) {
-		fbm_buffer[i] = 0;
+	if (fbm_cache == NULL) {
+		fbm_cache = (uint64_t*) malloc(FBM_BLOCKS*SIZE_BLOCK);
 	}
+	if (fbm_dirty == NULL) {
+		fbm_dirty = (char*) malloc(FBM_BLOCKS);
+	}
+	memset(fbm_cache, 0, FBM_BLOCKS*SIZE_BLOCK);
+	mask_fbm_tail();
 
-	// Need to modify FBM as the first data block is used for the i-node
-	modify_fbm(0, 1);
-	// Need to modify FBM as the last 4 data block is used for the root directory
-	modify_fbm(SIZE_BLOCK-1, 1);
-	modify_fbm(SIZE_BLOCK-2, 1);
-	modify_fbm(SIZE_BLOCK-3, 1);
-	modify_fbm(SIZE_BLOCK-4, 1);
-
-	free(fbm_buffer);
+	// The first data block is used for the i-node
+	fbm_cache[0] |= 1;
+	// The last data blocks are used for the root directory
+	for (int i=NUMBER_DATA_BLOCKS-DIRECTORY_BLOCKS; i<NUMBER_DATA_BLOCKS; i++) {
+		fbm_cache[i/64] |= (uint64_t) 1 << (i%64);
+	}
+	write_blocks(FBM_STARTING_ADDRESS, FBM_BLOCKS, fbm_cache);
+	memset(fbm_dirty, 0, FBM_BLOCKS);
 }
 
 /*
-/ Update the root directory on the disk
+/ Update the root directory on the disk, only the blocks modified since the last update
 */
 void update_directory_disk() {
-	Node* initial_inode = (Node*) malloc(SIZE_BLOCK);
-	// Look for root j-node
-	if (root_jnode == NULL) {
-		getRootJNode();
+	// Note: 0th i-node always points to root directory, its pointers are cached in dir_block_ptr
+	struct blk_iovec dir_iov[NB_DIRECT_PTRS];
+	int nb_blocks = 0;
+	for (int i=0; i<DIRECTORY_BLOCKS; i++) {
+		if (dir_block_dirty[i]) {
+			dir_iov[nb_blocks].start_address = DB_STARTING_ADDRESS + dir_block_ptr[i];
+			dir_iov[nb_blocks].nblocks = 1;
+			dir_iov[nb_blocks].buffer = &(root_dir_cache[i*SIZE_BLOCK/sizeof(Directory_entry)]);
+			nb_blocks++;
+			dir_block_dirty[i] = 0;
+		}
+	}
+	// Single submission for the modified blocks
+	if (nb_blocks > 0) {
+		write_blocks_v(dir_iov, nb_blocks);
 	}
-	// Get 0th i-node to get root directory 
-	read_blocks(DB_STARTING_ADDRESS + root_jnode[0].direct_ptr[0], 1, initial_inode);
-	// Update directory on disk
-	// Note: 0th i-node always points to root directory
-	write_blocks(DB_STARTING_ADDRESS + initial_inode[0].direct_ptr[0], 1, &(root_dir_cache[0]));
-	write_blocks(DB_STARTING_ADDRESS + initial_inode[0].direct_ptr[1], 1, &(root_dir_cache[SIZE_BLOCK/sizeof(Directory_entry)]));
-	write_blocks(DB_STARTING_ADDRESS + initial_inode[0].direct_ptr[2], 1, &(root_dir_cache[2*SIZE_BLOCK/sizeof(Directory_entry)]));
-	write_blocks(DB_STARTING_ADDRESS + initial_inode[0].direct_ptr[3], 1, &(root_dir_cache[3*SIZE_BLOCK/sizeof(Directory_entry)]));
-
-	free(initial_inode);
 }
 
 
@@ -236,62 +957,182 @@ void update_directory_disk() {
 / Set up the WM by intializing everything to 0. 
 */ 
 void set_wm() {
-	char* wm_buffer = (char*) malloc(SIZE_BLOCK);
-	for (int i = 0; i < SIZE_BLOCK; i++) {
-		wm_buffer[i] = 0;
-	}		
-	// First argument:WM is the 1027th block of the file system. So start address = 1026.
-	// Second argument: WM is one single block
+	char* wm_buffer = (char*) calloc(WM_BLOCKS, SIZE_BLOCK);
+	// First argument: WM follows the FBM at the end of the file system
+	// Second argument: WM spans one byte per data block
 	// Third argument: Buffer that contains the WM information
-	write_blocks(WM_STARTING_ADDRESS, 1, wm_buffer);
+	write_blocks(WM_STARTING_ADDRESS, WM_BLOCKS, wm_buffer);
 	free(wm_buffer);
 }
 
 /*
-/ Find an empty block and allocate it by modifying fbm
+/ Find the first run of nblocks empty data blocks, from where the last allocation left off. Returns its first block,
+/ -1 if there is no run that long
 */
-int find_empty_data_block() {
-	// Iterate through FBM to find unallocated blocks for the file
-	for (int j=0; j<NUMBER_DATA_BLOCKS; j++) {
-		if (fbm_cache[j] == 0) {
-			
-			// Modify FBM in disk and cache
-			modify_fbm(j, 1);
-			
-			return j;
-		}
-	}
-	// No more blocks available
-	printf("Error: No more available blocks\n");
+int find_empty_run(int nblocks) {
+	// Iterate through FBM a word at a time, skipping full words
+	int nb_words = (NUMBER_DATA_BLOCKS + 63) / 64;
+	for (int i=0; i<nb_words; i++) {
+		int word = (fbm_hint + i) % nb_words;
+		uint64_t free_bits = ~fbm_cache[word];
+		while (free_bits != 0) {
+			int start = word*64 + __builtin_ctzll(free_bits);
+			int length = 0;
+			while (length < nblocks && start+length < NUMBER_DATA_BLOCKS && !fbm_block_used(start+length)) {
+				length++;
+			}
+			if (length == nblocks) {
+				fbm_hint = word;
+				return start;
+			}
+			// Too short, drop the lowest run of empty blocks of this word
+			free_bits &= free_bits + (free_bits & -free_bits);
+		}
+	}
 	return -1;
 }
 
 /*
-/ Find an empty file descriptor and return its index
+/ Allocate up to nblocks contiguous empty data blocks by modifying fbm. The run starts at goal if that block is empty
+/ (-1 for no goal), otherwise at the first run of nblocks empty blocks, otherwise at the first empty block.
+/ Returns the first block and stores the number of blocks allocated in run_length, -1 if there is no empty block
 */
-int find_empty_fd() {
-	for (int i=0; i<MAX_FILES; i++) {
-		if (Open_Fd_Table[i].inode_nb == -1) {
-			return i;
+int allocate_data_run(int goal, int nblocks, int* run_length) {
+	int start = -1;
+	if (goal >= 0 && goal < NUMBER_DATA_BLOCKS && !fbm_block_used(goal)) {
+		start = goal;
+	}
+	else {
+		start = find_empty_run(nblocks);
+		if (start == -1 && nblocks > 1) {
+			start = find_empty_run(1);
 		}
 	}
-	// No more fd entries available
-	printf("Error: No more available file descriptors\n");
-	return -1;
+	if (start == -1) {
+		// No more blocks available
+		printf("Error: No more available blocks\n");
+		*run_length = 0;
+		return -1;
+	}
+	int length = 0;
+	while (length < nblocks && start+length < NUMBER_DATA_BLOCKS && !fbm_block_used(start+length)) {
+		// Modify FBM in cache, written back with the rest of the operation
+		modify_fbm(start+length, 1);
+		length++;
+	}
+	*run_length = length;
+	return start;
 }
 
 /*
-/ Initialize a new block of i-nodes in blocknb
+/ Find an empty block and allocate it by modifying fbm
 */
-int initialize_new_inode_block(int blocknb) {
+int find_empty_data_block() {
+	int length;
+	return allocate_data_run(-1, 1, &length);
+}
 
-	// Update root J-Node size since we are initializing a new block of inodes
-	if (root_jnode == NULL) {
-		getRootJNode();
+/*
+/ Allocate a data block for a new pointer block with every entry empty (-1), kept in the pointer block cache.
+/ Returns its block number, -1 if there is no empty block
+*/
+int new_ptr_block() {
+	int blocknb = find_empty_data_block();
+	if (blocknb == -1) {
+		return -1;
+	}
+	if (ptr_block_cache[blocknb] == NULL) {
+		ptr_block_cache[blocknb] = (int*) malloc(SIZE_BLOCK);
+	}
+	for (int i=0; i<SIZE_BLOCK/sizeof(int); i++) {
+		ptr_block_cache[blocknb][i] = -1;
+	}
+	mark_ptr_block_dirty(blocknb);
+	return blocknb;
+}
+
+/*
+/ Drop a pointer block from the cache and give its data block back
+*/
+void release_ptr_block(int blocknb) {
+	free(ptr_block_cache[blocknb]);
+	ptr_block_cache[blocknb] = NULL;
+	ptr_block_dirty[blocknb] = 0;
+	modify_fbm(blocknb, 0);
+}
+
+/*
+/ Set up an empty open file descriptor table, with no i-node open
+*/
+void initialize_fd_table() {
+	free(Open_Fd_Table);
+	free(fd_free_stack);
+	free(inode_fd_map);
+	fd_table_size = FD_TABLE_INITIAL_SIZE;
+	Open_Fd_Table = (Fd_entry*) malloc(fd_table_size*sizeof(Fd_entry));
+	fd_free_stack = (int*) malloc(fd_table_size*sizeof(int));
+	fd_free_count = 0;
+	// Walk down so the lowest file descriptor ends on top
+	for (int i=fd_table_size-1; i>=0; i--) {
+		Open_Fd_Table[i].inode_nb = -1;
+		Open_Fd_Table[i].read_ptr = -1;
+		Open_Fd_Table[i].write_ptr = -1;
+		fd_free_stack[fd_free_count++] = i;
+	}
+	inode_fd_map = (int*) malloc(NB_INODE_BLOCKS*SIZE_BLOCK/sizeof(Node)*sizeof(int));
+	for (int i=0; i<NB_INODE_BLOCKS*SIZE_BLOCK/sizeof(Node); i++) {
+		inode_fd_map[i] = -1;
 	}
-	(*root_jnode).size += SIZE_BLOCK;
-	updateSB();
+}
 
+/*
+/ Find an empty file descriptor and return its index, doubling the table if they are all in use
+*/
+int find_empty_fd() {
+	if (fd_free_count == 0) {
+		int new_size = fd_table_size*2;
+		Fd_entry* new_table = (Fd_entry*) realloc(Open_Fd_Table, new_size*sizeof(Fd_entry));
+		int* new_stack = (int*) realloc(fd_free_stack, new_size*sizeof(int));
+		if (new_table == NULL || new_stack == NULL) {
+			if (new_table != NULL) {
+				Open_Fd_Table = new_table;
+			}
+			if (new_stack != NULL) {
+				fd_free_stack = new_stack;
+			}
+			// No more fd entries available
+			printf("Error: No more available file descriptors\n");
+			return -1;
+		}
+		Open_Fd_Table = new_table;
+		fd_free_stack = new_stack;
+		for (int i=new_size-1; i>=fd_table_size; i--) {
+			Open_Fd_Table[i].inode_nb = -1;
+			Open_Fd_Table[i].read_ptr = -1;
+			Open_Fd_Table[i].write_ptr = -1;
+			fd_free_stack[fd_free_count++] = i;
+		}
+		fd_table_size = new_size;
+	}
+	return fd_free_stack[--fd_free_count];
+}
+
+/*
+/ Give back an open file descriptor, which becomes empty
+*/
+void release_fd(int fd_index) {
+	inode_fd_map[Open_Fd_Table[fd_index].inode_nb] = -1;
+	Open_Fd_Table[fd_index].inode_nb = -1;
+	Open_Fd_Table[fd_index].read_ptr = -1;
+	Open_Fd_Table[fd_index].write_ptr = -1;
+	fd_free_stack[fd_free_count++] = fd_index;
+}
+
+/*
+/ Initialize a new block of i-nodes in blocknb, which becomes block direct_ptr_nb of the i-node file.
+/ Only the block is written, the caller points the root j-node at it
+*/
+int initialize_new_inode_block(int blocknb, int direct_ptr_nb) {
 	// Create a block with empty i-nodes
 	Node* inode_buffer = (Node*) malloc(SIZE_BLOCK);
 
@@ -300,46 +1141,94 @@ int initialize_new_inode_block(int blocknb) {
 	//
 	Node empty_inode;
 	empty_inode.size = -1;
-	for (int i=0; i<14; i++) {
+	for (int i=0; i<NB_DIRECT_PTRS; i++) {
 		empty_inode.direct_ptr[i] = -1;
 	}
-	empty_inode.indirectPtr = -1;	
+	empty_inode.indirectPtr = -1;
+	empty_inode.doubleIndirectPtr = -1;
 	// Copy to empty i nodes to buffer	
 	for (int i=0; i<SIZE_BLOCK/sizeof(Node); i++) {
 		memcpy(&(inode_buffer[i]), &empty_inode, sizeof(Node));
 	}
 	write_blocks(DB_STARTING_ADDRESS + blocknb, 1, inode_buffer);
 
+	// Fresh i-nodes go straight into the i-node cache, already in sync with the disk
+	memcpy(&(inode_cache[direct_ptr_nb*SIZE_BLOCK/sizeof(Node)]), inode_buffer, SIZE_BLOCK);
+	inode_block_dirty[direct_ptr_nb] = 0;
+
 	free(inode_buffer);
 
 	return 0;
 }
 
+/*
+/ Take a free i-node and occupy it with an empty file, adding a block to the i-node file when the others are full.
+/ Returns the i-node number, -1 if there is none left
+*/
+int allocate_inode() {
+	if (inode_free_count == 0) {
+		// Find an unused root j-node pointer for a new block of i-nodes
+		// Enough blocks for the i-nodes of the super block
+		for (int i=0; i<NB_INODE_BLOCKS && i*SIZE_BLOCK/sizeof(Node) <= MAX_FILES; i++) {
+			if ((*root_jnode).direct_ptr[i] == -1) {
+				int inode_block_nb = find_empty_data_block();
+				if (inode_block_nb == -1) {
+					return -1;
+				}
+				initialize_new_inode_block(inode_block_nb, i);
+				// Add new inode block to jroot, once it is on disk
+				(*root_jnode).direct_ptr[i] = inode_block_nb;
+				(*root_jnode).size += SIZE_BLOCK;
+				// update j root in SB
+				updateSB();
+				// All its i-nodes are free, lowest on top
+				for (int x=SIZE_BLOCK/sizeof(Node)-1; x>=0; x--) {
+					if (i*SIZE_BLOCK/sizeof(Node) + x <= MAX_FILES) {
+						inode_free_list[inode_free_count++] = i*SIZE_BLOCK/sizeof(Node) + x;
+					}
+				}
+				break;
+			}
+		}
+		if (inode_free_count == 0) {
+			printf("Error: No more available i-nodes\n");
+			return -1;
+		}
+	}
+	int inode_nb = inode_free_list[--inode_free_count];
+	// Change size to 0 to occupy it
+	inode_cache[inode_nb].size = 0;
+	mark_inode_dirty(inode_nb);
+	return inode_nb;
+}
+
+/*
+/ Give back an i-node emptied by the caller (size -1) to the free i-node list
+*/
+void release_inode(int inode_nb) {
+	inode_free_list[inode_free_count++] = inode_nb;
+}
+
 /*
 / Add new root directory entry to root directory in cache and in disk
 */
 int add_new_root_directory_entry(char* name, int inode_nb) {
 
-	int entry_index = -1;
 	// Create new directory entry
 	Directory_entry entry;
 	strcpy(entry.filename, name);
 	entry.inode_nb = inode_nb;
 
-	// Find empty entry in root_directory
-	for (int i=0; i<MAX_FILES; i++) {
-		if (strcmp(root_dir_cache[i].filename, "") == 0) {
-			// Modify root_directory in cache
-			memcpy(&(root_dir_cache[i]), &entry, sizeof(Directory_entry));
-			entry_index = i;
-			break;
-		}
-	}
-
-	if (entry_index == -1) {
+	// Take an empty entry in root_directory
+	if (dir_free_count == 0) {
 		printf("Error: Not enough space in root directory\n");
 		return -1;
 	}
+	int entry_index = dir_free_slots[--dir_free_count];
+	// Modify root_directory in cache
+	memcpy(&(root_dir_cache[entry_index]), &entry, sizeof(Directory_entry));
+	mark_directory_dirty(entry_index);
+	index_directory_entry(entry_index);
 
 	// Get root j node
 	if (root_jnode == NULL) {
@@ -351,33 +1240,20 @@ int add_new_root_directory_entry(char* name, int inode_nb) {
 }
 
 /*
-/ Return the file size based on the i-node nb
+/ Return the file size based on the i-node nb. The size of the whole file is kept in the file's i-node in the cache,
+/ shared by every open file descriptor of the file. Indirect i-nodes only hold block pointers
 */
-int get_file_size(int inode_nb) {
+long long get_file_size(int inode_nb) {
 	if (inode_nb == -1) {
 		printf("Error: Negative inode_nb\n");
 		return 0;
 	}
-	// Get root j node
-	if (root_jnode == NULL) {
-		getRootJNode();
-	}
-	int direct_ptr_nb = inode_nb/(SIZE_BLOCK/sizeof(Node));
-	int block_nb = (*root_jnode).direct_ptr[direct_ptr_nb];
-	int inode_index_in_block = inode_nb % (SIZE_BLOCK/sizeof(Node));
+	// Get inode
+	Node* file_inode = get_inode(inode_nb);
 
-	if (block_nb > -1) {
-		// Get i-node block
-		Node* inode_block = (Node*) malloc(SIZE_BLOCK);
-		read_blocks(DB_STARTING_ADDRESS + block_nb, 1, inode_block);
-		// Get inode
-		Node file_inode = inode_block[inode_index_in_block];
+	if (file_inode != NULL) {
 		// Return size
-		int size = file_inode.size;
-		if (file_inode.indirectPtr != -1)
-			size += get_file_size(file_inode.indirectPtr);
-		free (inode_block);
-		return size;		
+		return (*file_inode).size;
 	}
 	else {
 		printf("Error: Negative Block number\n");
@@ -389,31 +1265,20 @@ int get_file_size(int inode_nb) {
 /*
 / Update the size of a file based on the i-node nb to the value in the second argument
 */
-int update_file_size(int inode_nb, int write_ptr, int length) {
+long long update_file_size(int inode_nb, long long write_ptr, long long length) {
 	if (inode_nb == -1) {
 		printf("Error: Negative inode_nb\n");
 		return -1;
 	}
-	// Get root j node
-	if (root_jnode == NULL) {
-		getRootJNode();
-	}
-	int direct_ptr_nb = inode_nb/(SIZE_BLOCK/sizeof(Node));
-	int block_nb = (*root_jnode).direct_ptr[direct_ptr_nb];
-	int inode_index_in_block = inode_nb % (SIZE_BLOCK/sizeof(Node));
-
-	if (block_nb > -1) {
-		// Get corresponding i-node block
-		Node* inode_block = (Node*) malloc(SIZE_BLOCK);
-		read_blocks(DB_STARTING_ADDRESS + block_nb, 1, inode_block);
+	// Get corresponding i-node
+	Node* file_inode = get_inode(inode_nb);
 
-		int old_size = get_file_size(inode_nb);
+	if (file_inode != NULL) {
 		// Size changed
-		if (old_size < write_ptr + length) {
-			inode_block[inode_index_in_block].size = write_ptr + length;
-			write_blocks(DB_STARTING_ADDRESS + block_nb, 1, inode_block);
+		if ((*file_inode).size < write_ptr + length) {
+			(*file_inode).size = write_ptr + length;
+			mark_inode_dirty(inode_nb);
 		}
-		free(inode_block);
 		return write_ptr + length;
 	}
 	else {
@@ -423,291 +1288,514 @@ int update_file_size(int inode_nb, int write_ptr, int length) {
 }
 
 /*
-/ Copy into the buffer, the file data block of an i-node based on the inode's direct pointer index (know which block of the file to get)
+/ Return the entry of a file's block map holding the data block of block file_block_nb: one of the i-node's direct
+/ pointers, then an entry of the single indirect pointer block, then of a pointer block under the double indirect one.
+/ Pointer blocks missing on the way are allocated if allocate is set, otherwise NULL is returned.
+/ map_block_nb is set to the pointer block holding the entry, -1 if the entry is in the i-node
 */
-int copy_data_block(int inode_nb, char* buffer, int inode_direct_ptr_index) {
-	if (inode_nb == -1) {
-		printf("Error: Negative inode_nb\n");
-		return -1;
+int* get_block_map_entry(int inode_nb, int file_block_nb, int allocate, int* map_block_nb) {
+	int ptrs_per_block = SIZE_BLOCK/sizeof(int);
+	*map_block_nb = -1;
+
+	// Get file's i-node
+	Node* inode = get_inode(inode_nb);
+	if (inode == NULL || file_block_nb < 0) {
+		return NULL;
 	}
-	// Get root j node
-	if (root_jnode == NULL) {
-		getRootJNode();
+	if (file_block_nb < NB_DIRECT_PTRS) {
+		return &((*inode).direct_ptr[file_block_nb]);
 	}
-	int direct_ptr_nb = inode_nb/(SIZE_BLOCK/sizeof(Node));
-	int block_nb = (*root_jnode).direct_ptr[direct_ptr_nb];
-	int inode_nb_in_block = inode_nb % (SIZE_BLOCK/sizeof(Node));
-
-	if (block_nb > -1) {
-		// Get i-node block
-		Node* inode_block = (Node*) malloc(SIZE_BLOCK);
-		read_blocks(DB_STARTING_ADDRESS + block_nb, 1, inode_block);
-		// Get i-node
-		Node inode = inode_block[inode_nb_in_block];
-		int file_block_nb = inode.direct_ptr[inode_direct_ptr_index];
-
-		// Store into buffer, the latest block of the file
-		read_blocks(DB_STARTING_ADDRESS + file_block_nb, 1, buffer);
-		free(inode_block);
-		// Return new data block number
-		return file_block_nb;	
+
+	// Need to use indirect pointers, one pointer block per level
+	int* entry;
+	int depth;
+	file_block_nb -= NB_DIRECT_PTRS;
+	if (file_block_nb < ptrs_per_block) {
+		entry = &((*inode).indirectPtr);
+		depth = 1;
 	}
 	else {
+		file_block_nb -= ptrs_per_block;
+		if (file_block_nb >= ptrs_per_block*ptrs_per_block) {
+			printf("Error: File too big\n");
+			return NULL;
+		}
+		entry = &((*inode).doubleIndirectPtr);
+		depth = 2;
+	}
+	for (int level=depth; level>0; level--) {
+		if (*entry == -1) {
+			if (!allocate) {
+				return NULL;
+			}
+			int blocknb = new_ptr_block();
+			if (blocknb == -1) {
+				return NULL;
+			}
+			*entry = blocknb;
+			if (*map_block_nb == -1) {
+				mark_inode_dirty(inode_nb);
+			}
+			else {
+				mark_ptr_block_dirty(*map_block_nb);
+			}
+		}
+		*map_block_nb = *entry;
+		int* ptr_block = get_ptr_block(*entry);
+		entry = &(ptr_block[(level == 2 ? file_block_nb/ptrs_per_block : file_block_nb) % ptrs_per_block]);
+	}
+	return entry;
+}
+
+/*
+/ Mark the i-node or pointer block holding an entry of a file's block map as modified
+*/
+void mark_block_map_dirty(int inode_nb, int map_block_nb) {
+	if (map_block_nb == -1) {
+		mark_inode_dirty(inode_nb);
+	}
+	else {
+		mark_ptr_block_dirty(map_block_nb);
+	}
+}
+
+/*
+/ Allocate data blocks to the blocks first to first+nblocks-1 of a file that have none. Consecutive file blocks are
+/ allocated as one run, placed right after the file's previous block when it is empty, so the file stays contiguous.
+/ Returns the number of blocks allocated, -1 if one was needed and none could be
+*/
+int get_data_blocks(int inode_nb, int first, int nblocks) {
+	// Can't get an inode with a negative number
+	if (inode_nb == -1) {
+		printf("Error: inode nb is in the wrong range\n");
+		return -1;
+	}
+	if (get_inode(inode_nb) == NULL) {
 		printf("Error: Negative Block number\n");
 		return -1;
 	}
+
+	int allocated = 0;
+	int needed = 0;
+	int file_block_nb = first;
+	while (file_block_nb < first + nblocks) {
+		int map_block_nb;
+		int* entry = get_block_map_entry(inode_nb, file_block_nb, 1, &map_block_nb);
+		if (entry == NULL) {
+			needed = 1;
+			break;
+		}
+		if (*entry != -1) {
+			file_block_nb++;
+			continue;
+		}
+		needed = 1;
+
+		// Reserve a run as long as the file blocks without a data block that follow
+		int wanted = 1;
+		while (file_block_nb + wanted < first + nblocks) {
+			int next_map_block_nb;
+			int* next = get_block_map_entry(inode_nb, file_block_nb + wanted, 0, &next_map_block_nb);
+			if (next != NULL && *next != -1) {
+				break;
+			}
+			wanted++;
+		}
+		int goal = -1;
+		int previous_map_block_nb;
+		int* previous = get_block_map_entry(inode_nb, file_block_nb - 1, 0, &previous_map_block_nb);
+		if (previous != NULL && *previous != -1) {
+			goal = *previous + 1;
+		}
+		int length;
+		int start = allocate_data_run(goal, wanted, &length);
+		if (start == -1) {
+			break;
+		}
+		for (int k=0; k<length; k++) {
+			entry = get_block_map_entry(inode_nb, file_block_nb + k, 1, &map_block_nb);
+			if (entry == NULL) {
+				// No room left for a pointer block, give back the rest of the run
+				for (int j=k; j<length; j++) {
+					modify_fbm(start + j, 0);
+				}
+				return allocated > 0 ? allocated : -1;
+			}
+			*entry = start + k;
+			mark_block_map_dirty(inode_nb, map_block_nb);
+			allocated++;
+		}
+		file_block_nb += length;
+	}
+	if (needed && allocated == 0) {
+		printf("Error: No data blocks or not enough pointers available\n");
+		return -1;
+	}
+	return allocated;
+}
+
+/*
+/ Return the data block holding block file_block_nb of a file, -1 if there is none. If allocate is set, a missing
+/ block (and the pointer blocks leading to it) is allocated to the file
+*/
+int get_file_block(int inode_nb, int file_block_nb, int allocate) {
+	int map_block_nb;
+	int* entry = get_block_map_entry(inode_nb, file_block_nb, allocate, &map_block_nb);
+	if (entry == NULL) {
+		return -1;
+	}
+	if (*entry == -1 && allocate) {
+		get_data_blocks(inode_nb, file_block_nb, 1);
+	}
+	return *entry;
+}
+
+/*
+/ Give back the data blocks mapped by a pointer block of the given depth (1 = entries are data blocks), then the
+/ pointer block itself
+*/
+void release_map_block(int blocknb, int depth) {
+	if (blocknb == -1) {
+		return;
+	}
+	int* ptr_block = get_ptr_block(blocknb);
+	for (int i=0; i<SIZE_BLOCK/sizeof(int); i++) {
+		if (ptr_block[i] != -1) {
+			if (depth > 1) {
+				release_map_block(ptr_block[i], depth-1);
+			}
+			else {
+				modify_fbm(ptr_block[i], 0);
+			}
+		}
+	}
+	release_ptr_block(blocknb);
+}
+
+/*
+/ Give back every data block of a file and the pointer blocks that map them, emptying its block map
+*/
+void release_file_blocks(int inode_nb) {
+	Node* inode = get_inode(inode_nb);
+	if (inode == NULL) {
+		return;
+	}
+	for (int i=0; i<NB_DIRECT_PTRS; i++) {
+		if ((*inode).direct_ptr[i] != -1) {
+			modify_fbm((*inode).direct_ptr[i], 0);
+			(*inode).direct_ptr[i] = -1;
+		}
+	}
+	release_map_block((*inode).indirectPtr, 1);
+	release_map_block((*inode).doubleIndirectPtr, 2);
+	(*inode).indirectPtr = -1;
+	(*inode).doubleIndirectPtr = -1;
+	mark_inode_dirty(inode_nb);
+}
+
+/*
+/ Describe blocks first to first+count-1 of a file as runs of contiguous data blocks, one blk_iovec per run,
+/ transferring to/from consecutive blocks of buffer.
+/ Returns the number of runs, -1 if one of the blocks is not allocated
+*/
+int file_block_runs(int inode_nb, int first, int count, char* buffer, struct blk_iovec* runs) {
+	int nb_runs = 0;
+	for (int i=0; i<count; i++) {
+		int block_nb = get_file_block(inode_nb, first+i, 0);
+		if (block_nb == -1) {
+			return -1;
+		}
+		// Block continues the previous run
+		if (nb_runs > 0 && runs[nb_runs-1].start_address + runs[nb_runs-1].nblocks == DB_STARTING_ADDRESS + block_nb) {
+			runs[nb_runs-1].nblocks++;
+		}
+		else {
+			runs[nb_runs].start_address = DB_STARTING_ADDRESS + block_nb;
+			runs[nb_runs].nblocks = 1;
+			runs[nb_runs].buffer = &(buffer[i*SIZE_BLOCK]);
+			nb_runs++;
+		}
+	}
+	return nb_runs;
 }
 
 /*
-/ Function that returns the new data block allocated for a file and that allocates a new data block to a file by updating the i-node's direct pointers
+/ Read runs of blocks with all of them in flight at once, so the disk serves them in the order it prefers
+/ instead of one after the other. Returns 0, -1 if a run could not be read
 */
-int get_data_block(int inode_nb) {
-	// Can't get an inode with a negative number
-	if (inode_nb == -1) {
-		printf("Error: inode nb is in the wrong range\n");
-		return -1;
+int read_runs(struct blk_iovec* runs, int nb_runs) {
+	// A single run has nothing to overlap with
+	if (nb_runs <= 1) {
+		return read_blocks_v(runs, nb_runs) < 0 ? -1 : 0;
 	}
-	// Get root j node
-	if (root_jnode == NULL) {
-		getRootJNode();
+	struct blk_completion* done = (struct blk_completion*) malloc(nb_runs * sizeof(struct blk_completion));
+	if (done == NULL) {
+		return read_blocks_v(runs, nb_runs) < 0 ? -1 : 0;
 	}
-	// Integer divison to find which inode block
-	// Modulus operator to find which inode in the block of inodes
-	int direct_ptr_nb = inode_nb/(SIZE_BLOCK/sizeof(Node));
-	int block_nb = (*root_jnode).direct_ptr[direct_ptr_nb];
-	int inode_nb_in_block = inode_nb % (SIZE_BLOCK/sizeof(Node));
-
-	if (block_nb > -1) {
-		// Allocate buffer for the i-node block
-		Node* buffer = (Node*) malloc(SIZE_BLOCK);
-		read_blocks(DB_STARTING_ADDRESS + block_nb, 1, buffer);
-
-		int db_nb = find_empty_data_block();
-		if (db_nb > -1) {
-			// Get file's i-node and modify pointers
-			Node inode = buffer[inode_nb_in_block];
-			// boolean indicating if the block has been allocated to a direct pointer of the i-node
-			int found = 0;
-			for (int i=0; i<14; i++) {
-				// Empty direct pointer
-				if (inode.direct_ptr[i] == -1) {
-					inode.direct_ptr[i] = db_nb;
-					memcpy(&(buffer[inode_nb_in_block]), &inode, sizeof(Node));
-					// Modify i-node block
-					found = 1;
-					write_blocks(DB_STARTING_ADDRESS + block_nb, 1, buffer);
-					break;
-				}
-			}
-			free(buffer);
-			// Need to use indirect pointer to point to a new inode
-			if (found == 0) {
-				
-				printf("Error: No data blocks or not enough direct pointers available\n");
-				return -1;
-			}
+
+	int res = 0;
+	int submitted = 0;
+	for (int i=0; i<nb_runs; i++) {
+		if (submit_read(runs[i].start_address, runs[i].nblocks, runs[i].buffer, &(runs[i])) == 0) {
+			submitted++;
 		}
-		else {
-			printf("Error: No data blocks available\n");
-			free(buffer);
-			return -1;
+		// Read the run here when it can't be queued
+		else if (read_blocks_v(&(runs[i]), 1) < 0) {
+			res = -1;
 		}
-		return block_nb;	
 	}
-	else {
-		printf("Error: Negative Block number\n");
-		return -1;
-	}	
+	// Every submitted run must be reaped before its buffer is let go
+	while (submitted > 0) {
+		int n = poll_completions(done, submitted, submitted);
+		if (n == 0) {
+			res = -1;
+			break;
+		}
+		for (int i=0; i<n; i++) {
+			if (done[i].result != ((struct blk_iovec*) done[i].user_data)->nblocks) {
+				res = -1;
+			}
+		}
+		submitted -= n;
+	}
+	free(done);
+	return res;
 }
 
 
+/*
+/ Set up every cache of the mounted file system
+*/
+void initialize_caches() {
+	// Set up root j-node
+	getRootJNode();
+
+	// I-Node Cache
+	initialize_inode_cache();
+
+	// Root Directory Cache, found through the 0th i-node
+	initialize_directory_cache();
+	initialize_directory_index();
+
+	// FBM Cache
+	initialize_fbm_cache();
+
+	// Pointer Block Cache
+	initialize_ptr_block_cache();
+
+	// Open File Descriptor Table
+	initialize_fd_table();
+}
+
 //
 // Create/Load file system
 //
 void mkssfs(int fresh){
-	// Initialize new fresh disk
+	// Initialize new fresh disk, with the default geometry
 	if (fresh == 1) {
+		mkssfs_ex(DEFAULT_SIZE_BLOCK, DEFAULT_FILE_SYSTEM_SIZE, DEFAULT_NUMBER_INODES);
+		return;
+	}
 
-		int init = init_fresh_disk(DISK_NAME, SIZE_BLOCK, FILE_SYSTEM_SIZE);
-		// Check if error initializing disk
-		if (init == -1) {
-			printf("Error: init_fresh_disk returned -1\n");
-		}
+	// Mount with the configured durability mode and buffer cache
+	disk_set_durability(DURABILITY_MODE);
+	disk_set_cache(CACHE_BLOCKS, DISK_CACHE_CLOCK);
+	release_caches();
 
-		////////////////////////
-		// Set up Super Block //
-		////////////////////////
-		int sb_byte_count = 0;
-		int* sb_buffer_start = (int*) malloc(SIZE_BLOCK);
-		int* sb_buffer = sb_buffer_start;
+	// Initialize existing disk, with the layout recorded in its super block
+	if (init_disk_layout() == -1) {
+		return;
+	}
+	// Disks of format version 5 are converted in place
+	if (upgrade_format() == -1) {
+		return;
+	}
 
-		//
-		// Initialize Magic Entry
-		//
-		*sb_buffer = 0xACBD0005;
-		sb_buffer++;
-		sb_byte_count += sizeof(int);
-		//
-		// Initialize Block Size
-		//
-		*sb_buffer = SIZE_BLOCK;
-		sb_buffer++;
-		sb_byte_count += sizeof(int);
-		//
-		// Initialize File System Size
-		//
-		*sb_buffer = FILE_SYSTEM_SIZE;
-		sb_buffer++;
-		sb_byte_count += sizeof(int);
-		//
-		// Initialize Number of i-nodes
-		//
-		// 1 i-node for directory, so 200 total
-		*sb_buffer = MAX_FILES+1;
-		sb_buffer++;
-		sb_byte_count += sizeof(int);		
+	initialize_caches();
+}
+
+//
+// Create a file system of nb_blocks blocks of block_size bytes with nb_inodes i-nodes, and load it.
+// Returns -1 if the geometry can't hold a file system
+//
+int mkssfs_ex(int block_size, int nb_blocks, int nb_inodes){
+	// Metadata layout of the new disk
+	if (set_layout(block_size, nb_blocks, nb_inodes) == -1) {
+		return -1;
+	}
 
-		// Cast pointer type
-		Node* sb_buffer_node = (Node*) sb_buffer;
+	// Mount with the configured durability mode and buffer cache
+	disk_set_durability(DURABILITY_MODE);
+	disk_set_cache(CACHE_BLOCKS, DISK_CACHE_CLOCK);
+	release_caches();
 
-		//
-		// Initialize Root (j-nodes)
-		//
-		Node root;
-		// size is 1024 since it should contain at least one i-node block of 1024 bytes which contains an i-node that points to the root directory
-		root.size = 1024;
-		for (int i=0; i<14; i++) {
-			root.direct_ptr[i] = -1;
+	int init = init_fresh_disk(DISK_NAME, SIZE_BLOCK, FILE_SYSTEM_SIZE);
+	// Check if error initializing disk
+	if (init == -1) {
+		printf("Error: init_fresh_disk returned -1\n");
+		return -1;
+	}
+
+	////////////////////////
+	// Set up Super Block //
+	////////////////////////
+	int sb_byte_count = 0;
+	int* sb_buffer_start = (int*) malloc(SIZE_BLOCK);
+	int* sb_buffer = sb_buffer_start;
+
+	//
+	// Initialize Magic Entry
+	//
+	*sb_buffer = SB_MAGIC;
+	sb_buffer++;
+	sb_byte_count += sizeof(int);
+	//
+	// Initialize Block Size
+	//
+	*sb_buffer = SIZE_BLOCK;
+	sb_buffer++;
+	sb_byte_count += sizeof(int);
+	//
+	// Initialize File System Size
+	//
+	*sb_buffer = FILE_SYSTEM_SIZE;
+	sb_buffer++;
+	sb_byte_count += sizeof(int);
+	//
+	// Initialize Number of i-nodes
+	//
+	// 1 i-node for directory
+	*sb_buffer = MAX_FILES+1;
+	sb_buffer++;
+	sb_byte_count += sizeof(int);
+
+	// Cast pointer type
+	Jnode* sb_buffer_node = (Jnode*) sb_buffer;
+
+	//
+	// Initialize Root (j-nodes)
+	//
+	Jnode root;
+	// size is one block since it should contain at least one i-node block which contains an i-node that points to the root directory
+	root.size = SIZE_BLOCK;
+	for (int i=0; i<NB_INODE_BLOCKS; i++) {
+		root.direct_ptr[i] = -1;
+	}
+	// ptr at index 0 points to first i-node block which is located in the 0th data block
+	root.direct_ptr[0] = 0;
+	root.indirectPtr = -1;
+	root.doubleIndirectPtr = -1;
+
+	memcpy(sb_buffer_node, &root, sizeof(Jnode));
+	sb_buffer_node++;
+	sb_byte_count += sizeof(Jnode);
+
+	//
+	// Initialize Layout, read back at mount
+	//
+	store_layout(sb_buffer_start);
+	sb_buffer = (int*) sb_buffer_node;
+	sb_buffer += SB_LAYOUT_FIELDS;
+	sb_byte_count += SB_LAYOUT_FIELDS*sizeof(int);
+	sb_buffer_node = (Jnode*) sb_buffer;
+
+	//
+	// Initialize Empty Shadow Roots
+	//
+	while (sb_byte_count+sizeof(Jnode) < SIZE_BLOCK) {
+		Jnode shadow_root;
+		shadow_root.size = -1;
+		for (int i=0; i<NB_INODE_BLOCKS; i++) {
+			shadow_root.direct_ptr[i] = -1;
 		}
-		// ptr at index 0 points to first i-node block which is located in the 0th data block
-		root.direct_ptr[0] = 0;
-		root.indirectPtr = -1;
+		shadow_root.indirectPtr = -1;
+		shadow_root.doubleIndirectPtr = -1;
 
-		memcpy(sb_buffer_node, &root, sizeof(Node));
+		memcpy(sb_buffer_node, &shadow_root, sizeof(Jnode));
 		sb_buffer_node++;
-		sb_byte_count += sizeof(Node);
-
-		//
-		// Initialize Empty Shadow Roots
-		//
-		while (sb_byte_count+sizeof(Node) < SIZE_BLOCK) {
-			Node shadow_root;
-			shadow_root.size = -1;
-			for (int i=0; i<14; i++) {
-				shadow_root.direct_ptr[i] = -1;
-			}
-			shadow_root.indirectPtr = -1;
-
-			memcpy(sb_buffer_node, &shadow_root, sizeof(Node));
-			sb_buffer_node++;
-			sb_byte_count += sizeof(Node);
-		}
-
-		//
-		// Initialy rest of memory with 0s
-		//
-		sb_buffer = (int*) sb_buffer_node;
-		int empty_space = 0;
-		while (sb_byte_count < SIZE_BLOCK) {
-			memcpy(sb_buffer, &empty_space, sizeof(int));
-			sb_buffer++;
-			sb_byte_count += sizeof(int);
-		}	
-
-		// First argument: Super Block is the first block of the file system. So start address = 0.
-		// Second argument: Super Block is one single block
-		// Third argument: Buffer that contains the super block information
-		write_blocks(SB_STARTING_ADDRESS, 1, sb_buffer_start);
-
-		////////////////
-		// Set up FBM //
-		////////////////
-		set_fbm();
-
-		////////////////
-		// Set up WM //
-		////////////////
-		set_wm();
-
-		////////////////////////////////////////
-		// Initialize file containing i-nodes //
-		////////////////////////////////////////
-		
-		// Create a block with one i-node and filled with other empty i-nodes
-		Node* inode_buffer = malloc(SIZE_BLOCK);
-
-		//
-		// Create directory i-node
-		//
-		Node directory_inode;
-
-		// i-node of size 4 blocks (max 199 files, which span 3.1 blocks, the rest are empty)
-		directory_inode.size = SIZE_BLOCK*4;
-		// ptr to the last data blocks for the directory
-		// ROOT DIRECTORY IN THE LAST 4 DATA BLOCK
-		directory_inode.direct_ptr[0] = FBM_STARTING_ADDRESS-4-1;
-		directory_inode.direct_ptr[1] = FBM_STARTING_ADDRESS-3-1;
-		directory_inode.direct_ptr[2] = FBM_STARTING_ADDRESS-2-1;
-		directory_inode.direct_ptr[3] = FBM_STARTING_ADDRESS-1-1;
-		for (int i=4; i<14; i++) {
-			directory_inode.direct_ptr[i] = -1;
-		}
-		directory_inode.indirectPtr = -1;
-		memcpy(inode_buffer, &directory_inode, sizeof(Node));
-		//
-		// Create empty i-nodes
-		//
-		Node empty_inode;
-		empty_inode.size = -1;
-		for (int i=0; i<14; i++) {
-			empty_inode.direct_ptr[i] = -1;
-		}
-		empty_inode.indirectPtr = -1;		
-		for (int i=1; i<SIZE_BLOCK/sizeof(Node); i++) {
-			memcpy(&(inode_buffer[i]), &empty_inode, sizeof(Node));
-		}
-		write_blocks(DB_STARTING_ADDRESS, 1, inode_buffer);
-
-
-		///////////////////////////
-		// Set up Root Directory //
-		///////////////////////////
-		set_directory();
-
-		//////////////////////
-		// Free All Buffers //
-		//////////////////////
-		free(sb_buffer_start);
-		free(inode_buffer);
-
-	}
-	// Initialize existing disk
-	else {
-		int init = init_disk(DISK_NAME, SIZE_BLOCK, FILE_SYSTEM_SIZE);
-		if (init == -1) {
-			printf("Error: init_disk returned -1\n");
-		}
+		sb_byte_count += sizeof(Jnode);
 	}
 
-	///////////////////
-	// Set up Caches //
-	///////////////////
+	//
+	// Initialy rest of memory with 0s
+	//
+	sb_buffer = (int*) sb_buffer_node;
+	int empty_space = 0;
+	while (sb_byte_count < SIZE_BLOCK) {
+		memcpy(sb_buffer, &empty_space, sizeof(int));
+		sb_buffer++;
+		sb_byte_count += sizeof(int);
+	}	
+
+	// First argument: Super Block is the first block of the file system. So start address = 0.
+	// Second argument: Super Block is one single block
+	// Third argument: Buffer that contains the super block information
+	write_blocks(SB_STARTING_ADDRESS, 1, sb_buffer_start);
 
-	// Root Directory Cache
-	initialize_directory_cache();
+	////////////////
+	// Set up FBM //
+	////////////////
+	set_fbm();
 
-	// FBM Cache
-	initialize_fbm_cache();
+	////////////////
+	// Set up WM //
+	////////////////
+	set_wm();
 
-	// Set up root j-node
-	getRootJNode();
+	////////////////////////////////////////
+	// Initialize file containing i-nodes //
+	////////////////////////////////////////
+	
+	// Create a block with one i-node and filled with other empty i-nodes
+	Node* inode_buffer = malloc(SIZE_BLOCK);
 
-	// Open File Descriptor Table
-	for (int i=0; i<MAX_FILES; i++) {
-		Open_Fd_Table[i].inode_nb = -1;
-		Open_Fd_Table[i].read_ptr = -1;
-		Open_Fd_Table[i].write_ptr = -1;
+	//
+	// Create directory i-node
+	//
+	Node directory_inode;
+
+	// i-node of the directory blocks (enough for MAX_FILES entries, the rest are unusable)
+	directory_inode.size = SIZE_BLOCK*DIRECTORY_BLOCKS;
+	// ptr to the last data blocks for the directory
+	// ROOT DIRECTORY IN THE LAST DATA BLOCKS
+	for (int i=0; i<NB_DIRECT_PTRS; i++) {
+		directory_inode.direct_ptr[i] = i < DIRECTORY_BLOCKS ? NUMBER_DATA_BLOCKS - DIRECTORY_BLOCKS + i : -1;
+	}
+	directory_inode.indirectPtr = -1;
+	directory_inode.doubleIndirectPtr = -1;
+	memcpy(inode_buffer, &directory_inode, sizeof(Node));
+	//
+	// Create empty i-nodes
+	//
+	Node empty_inode;
+	empty_inode.size = -1;
+	for (int i=0; i<NB_DIRECT_PTRS; i++) {
+		empty_inode.direct_ptr[i] = -1;
+	}
+	empty_inode.indirectPtr = -1;
+	empty_inode.doubleIndirectPtr = -1;
+	for (int i=1; i<SIZE_BLOCK/sizeof(Node); i++) {
+		memcpy(&(inode_buffer[i]), &empty_inode, sizeof(Node));
 	}
+	write_blocks(DB_STARTING_ADDRESS, 1, inode_buffer);
+
+
+	///////////////////////////
+	// Set up Root Directory //
+	///////////////////////////
+	set_directory();
+
+	// Format is complete before any file operation
+	disk_barrier();
+
+	//////////////////////
+	// Free All Buffers //
+	//////////////////////
+	free(sb_buffer_start);
+	free(inode_buffer);
+
+	initialize_caches();
+	return 0;
 }
 
 /*
@@ -717,12 +1805,10 @@ int ssfs_fopen(char *name){
 
 	// CHECK FILE EXISTS
 	int file_inode_nb = -1;
-	// Iterate through root directory and find matching filename
-	for (int i=0; i<MAX_FILES; i++) {
-		if (strcmp(name, root_dir_cache[i].filename) == 0) {
-			file_inode_nb = root_dir_cache[i].inode_nb;
-			break;
-		}
+	// Look up the filename in the root directory index
+	int dir_slot = find_directory_entry(name);
+	if (dir_slot != -1) {
+		file_inode_nb = root_dir_cache[dir_slot].inode_nb;
 	}
 
 	////////////////////////////////////
@@ -739,102 +1825,66 @@ int ssfs_fopen(char *name){
 			getRootJNode();
 		}
 
-		// NESTED FOR LOOP: 1st Loop: Scan through i-node file pointed by the root
-		//                  2nd Loop: Scan through each i-node block and find an empty i-node with size -1
-		// iterate through each inode block
-		for (int i=0; i<14; i++) {
-			// Hold block of inodes
-			Node* block_inode = (Node*) malloc(SIZE_BLOCK);
-			// Unintialized block of i-nodes
-			if ((*root_jnode).direct_ptr[i] == -1) {
-				int inode_block_nb = find_empty_data_block();
-				if (inode_block_nb == -1) {
-					free(block_inode);
-					return -1;
-				}
-				initialize_new_inode_block(inode_block_nb);
-				// Add new inode block to jroot
-				(*root_jnode).direct_ptr[i] = inode_block_nb;
-				// update j root in SB
-				updateSB();
-			}
-			read_blocks(DB_STARTING_ADDRESS + (*root_jnode).direct_ptr[i], 1, block_inode);
-
-			// iterate through each individual inode in a block
-			for (int x=0; x<SIZE_BLOCK/sizeof(Node); x++) {
-				// found empty inode
-				if (block_inode[x].size == -1) {
-					// Change size to 0 to occupy it
-					block_inode[x].size = 0;
-					// Update i-node block in disk
-					write_blocks(DB_STARTING_ADDRESS + (*root_jnode).direct_ptr[i], 1, block_inode);
-					free(block_inode);
-
-					int inode_nb = i*SIZE_BLOCK/sizeof(Node) + x;
-					///////////////////////////////////
-					// Allocate root_directory entry //
-					///////////////////////////////////
-					add_new_root_directory_entry(name, inode_nb);
-
-					////////////////////////////////////
-					// Allocate open file table entry //
-					////////////////////////////////////
-					int fd_index = find_empty_fd();
-					if (fd_index > -1 && fd_index < MAX_FILES) {
-						Open_Fd_Table[fd_index].inode_nb = inode_nb;
-						Open_Fd_Table[fd_index].read_ptr = 0;
-						Open_Fd_Table[fd_index].write_ptr = 0;
-						// return new file descriptor index
-						return fd_index;						
-					}
-					printf("Error: Not enough space in open file table entry\n");
-					return -1;
-				}
-			}
-			free(block_inode);
-		}	
+		// Take an empty i-node from the free i-node list
+		int inode_nb = allocate_inode();
+		if (inode_nb == -1) {
+			return -1;
+		}
+
+		///////////////////////////////////
+		// Allocate root_directory entry //
+		///////////////////////////////////
+		if (add_new_root_directory_entry(name, inode_nb) == -1) {
+			// No room for the file, give its i-node back
+			inode_cache[inode_nb].size = -1;
+			release_inode(inode_nb);
+			sync_operation();
+			return -1;
+		}
+
+		// New file reaches the disk before ssfs_fopen returns
+		sync_operation();
+
+		////////////////////////////////////
+		// Allocate open file table entry //
+		////////////////////////////////////
+		int fd_index = find_empty_fd();
+		if (fd_index > -1) {
+			Open_Fd_Table[fd_index].inode_nb = inode_nb;
+			Open_Fd_Table[fd_index].read_ptr = 0;
+			Open_Fd_Table[fd_index].write_ptr = 0;
+			inode_fd_map[inode_nb] = fd_index;
+			// return new file descriptor index
+			return fd_index;						
+		}
+		printf("Error: Not enough space in open file table entry\n");
+		return -1;
 	}
 	/////////////////////////////
 	// SCENARIO 2: FILE EXISTS //
 	/////////////////////////////
 	else {
+		// Get inode
+		Node* file_inode = get_inode(file_inode_nb);
+		if (file_inode == NULL) {
+			printf("Error: block_number is negative\n");
+			return -1;				
+		}
 		// Check if it already exists in the open file table
-		for (int i=0; i<MAX_FILES; i++) {
-			if (Open_Fd_Table[i].inode_nb == file_inode_nb) {
-				return i;
-			}
+		if (inode_fd_map[file_inode_nb] != -1) {
+			return inode_fd_map[file_inode_nb];
 		}
 		// File is not in the open file table so open in append mode
 		int fd_index = find_empty_fd();
-		if (fd_index > -1 && fd_index < MAX_FILES) {
-			// Get root j node
-			if (root_jnode == NULL) {
-				getRootJNode();
-			}
-			int direct_ptr_nb = file_inode_nb/(SIZE_BLOCK/sizeof(Node));
-			int block_number = (*root_jnode).direct_ptr[direct_ptr_nb];
-			int inode_nb_in_block = file_inode_nb % (SIZE_BLOCK/sizeof(Node));
-			if (block_number > -1) {
-				// Get inode block
-				Node* inode_block = (Node*) malloc(SIZE_BLOCK);
-				read_blocks(DB_STARTING_ADDRESS + block_number, 1, inode_block);
-				// Get inode
-				Node file_inode = inode_block[inode_nb_in_block];
-				// Change file descriptor entry
-				Fd_entry entry;
-				entry.inode_nb = file_inode_nb;
-				entry.read_ptr = 0;
-				entry.write_ptr = file_inode.size;
-				// Copy to cache
-				memcpy(&(Open_Fd_Table[fd_index]), &entry, sizeof(Fd_entry));
-				free(inode_block);
-				return fd_index;
-			}
-			else {
-				printf("Error: block_number is negative\n");
-				return -1;				
-			}
-
+		if (fd_index > -1) {
+			// Change file descriptor entry
+			Fd_entry entry;
+			entry.inode_nb = file_inode_nb;
+			entry.read_ptr = 0;
+			entry.write_ptr = (*file_inode).size;
+			// Copy to cache
+			memcpy(&(Open_Fd_Table[fd_index]), &entry, sizeof(Fd_entry));
+			inode_fd_map[file_inode_nb] = fd_index;
 			// return new file descriptor index
 			return fd_index;						
 		}
@@ -852,7 +1902,7 @@ int ssfs_fopen(char *name){
 */
 int ssfs_fclose(int fileID){
 
-	if (fileID < 0 || fileID > MAX_FILES) {
+	if (fileID < 0 || fileID >= fd_table_size) {
 		printf("Error: Incorrect fileID\n");
 		return -1;
 	}
@@ -864,9 +1914,7 @@ int ssfs_fclose(int fileID){
 	}
 	else {
 		// Create an empty fd
-		Open_Fd_Table[fileID].inode_nb = -1;
-		Open_Fd_Table[fileID].read_ptr = -1;
-		Open_Fd_Table[fileID].write_ptr = -1;
+		release_fd(fileID);
 	}
 
     return 0;
@@ -875,9 +1923,9 @@ int ssfs_fclose(int fileID){
 //
 // Seek (Read) to the location specified by argument "loc", from the beginning of the file pointed by the file's ID
 //
-int ssfs_frseek(int fileID, int loc){
+int ssfs_frseek(int fileID, long long loc){
 
-	if (fileID < 0 || fileID > MAX_FILES) {
+	if (fileID < 0 || fileID >= fd_table_size) {
 		printf("Error: Incorrect fileID\n");
 		return -1;
 	}
@@ -907,9 +1955,9 @@ int ssfs_frseek(int fileID, int loc){
 //
 // Seek (Write) to the location specified by argument "loc", from the beginning of the file pointed by the file's ID
 //
-int ssfs_fwseek(int fileID, int loc){
+int ssfs_fwseek(int fileID, long long loc){
 
-	if (fileID < 0 || fileID > MAX_FILES) {
+	if (fileID < 0 || fileID >= fd_table_size) {
 		printf("Error: Incorrect fileID\n");
 		return -1;
 	}
@@ -938,274 +1986,189 @@ int ssfs_fwseek(int fileID, int loc){
 //
 // Write the string from "buf" of size "length" into the file pointed by the file's ID
 //
-int ssfs_fwrite(int fileID, char *buf, int length){
+long long ssfs_fwrite(int fileID, char *buf, long long length){
 
-	if (length < 0) {
+	if (length <= 0) {
 		return 0;
 	}
 
-	if (fileID < 0 || fileID > MAX_FILES) {
+	if (fileID < 0 || fileID >= fd_table_size) {
 		printf("Error: Incorrect fileID\n");
 		return 0;
 	}
 
 	// Get the file entry and file size
 	Fd_entry file_entry = Open_Fd_Table[fileID];
-
-	int block_write_nb = file_entry.write_ptr / SIZE_BLOCK;
-
-	// Get root j node
-	if (root_jnode == NULL) {
-		getRootJNode();
-	}
-	int direct_ptr_nb = file_entry.inode_nb/(SIZE_BLOCK/sizeof(Node));
-	int block_nb = (*root_jnode).direct_ptr[direct_ptr_nb];
-	int inode_index_in_block = file_entry.inode_nb % (SIZE_BLOCK/sizeof(Node));
 	int inode_nb = file_entry.inode_nb;
-	if (block_nb > -1) {
-		// Get i-node block
-		Node* inode_block = (Node*) malloc(SIZE_BLOCK);
-		read_blocks(DB_STARTING_ADDRESS + block_nb, 1, inode_block);
-		// Get inode
-		Node file_inode = inode_block[inode_index_in_block];
-		////////////////////////////////////////////////
-		// SPECIAL SCENARIO: Need to use indirect_ptr //
-		////////////////////////////////////////////////
-		if (block_write_nb > 13) {
-			// Find an empty inode (like for open)
-			for (int i=0; i<14; i++) {
-				// Hold block of inodes
-				Node* block_inode = (Node*) malloc(SIZE_BLOCK);
-				// Unintialized block of i-nodes
-				if ((*root_jnode).direct_ptr[i] == -1) {
-					int inode_block_nb = find_empty_data_block();
-					if (inode_block_nb == -1) {
-						free(block_inode);
-						return -1;
-					}
-					initialize_new_inode_block(inode_block_nb);
-					// Add new inode block to jroot
-					(*root_jnode).direct_ptr[i] = inode_block_nb;
-					// update j root in SB
-					updateSB();
-				}
-				read_blocks(DB_STARTING_ADDRESS + (*root_jnode).direct_ptr[i], 1, block_inode);
-				// iterate through each individual inode in a block
-				for (int x=0; x<SIZE_BLOCK/sizeof(Node); x++) {
-					//found empty inode
-					if (block_inode[x].size == -1) {
-						// Change size to 0 to occupy it
-						block_inode[x].size = 0;
-
-						// Update i-node block in disk
-						write_blocks(DB_STARTING_ADDRESS + (*root_jnode).direct_ptr[i], 1, block_inode);
-						free(block_inode);
-						// update new i-node in which we change the direct pointer
-						file_inode.indirectPtr = i*SIZE_BLOCK/sizeof(Node) + x;
-
-						memcpy(&(inode_block[inode_index_in_block]), &file_inode, sizeof(Node));
-						write_blocks(DB_STARTING_ADDRESS + block_nb, 1, inode_block);
-
-						inode_nb = file_inode.indirectPtr;
-
-						block_write_nb = block_write_nb % 14;
-						get_data_block(inode_nb);
-						// Exit nested loop
-						x = 500;
-						i = 500;
-					}
 
-				}
-			}	
-		}
-		/////////////////////
-		// NORMAL SCENARIO //
-		/////////////////////
-		else if (file_inode.direct_ptr[block_write_nb] == -1)
-			get_data_block(file_entry.inode_nb);
-		free (inode_block);
-	}
-	else {
+	// Get inode
+	Node* file_inode = get_inode(inode_nb);
+	if (file_inode == NULL) {
 		printf("Error: Negative Block number\n");
 		return 0;
 	}
+	long long size = get_file_size(inode_nb);
 
-	char* block = (char*) malloc(SIZE_BLOCK);
-	int data_block_nb = copy_data_block(inode_nb, block, block_write_nb);
-
-	if (data_block_nb == -1) {
-		printf("Error: Error getting block in ssfs_fwrite\n");
-		free(block);
-		return 0;
+	// Reserve in runs the blocks of the write the file does not have yet
+	int block_write_nb = file_entry.write_ptr / SIZE_BLOCK;
+	int last_block_write_nb = (file_entry.write_ptr + length - 1) / SIZE_BLOCK;
+	get_data_blocks(inode_nb, block_write_nb, last_block_write_nb - block_write_nb + 1);
+
+	char* block = NULL;
+	long long written = 0;
+	while (written < length) {
+		int data_block_nb = get_file_block(inode_nb, block_write_nb, 1);
+		if (data_block_nb == -1) {
+			printf("Error: Error getting block in ssfs_fwrite\n");
+			break;
+		}
+		int offset = (file_entry.write_ptr + written) % SIZE_BLOCK;
+
+		/////////////////////////////////////////////////////////////
+		// Partial head or tail block: read, modify and write back //
+		/////////////////////////////////////////////////////////////
+		if (offset != 0 || length - written < SIZE_BLOCK) {
+			int chunk = SIZE_BLOCK - offset;
+			if (chunk > length - written) {
+				chunk = length - written;
+			}
+			if (block == NULL) {
+				block = (char*) malloc(SIZE_BLOCK);
+			}
+			// Nothing of the file is stored in the block yet, no need to read it
+			if ((long long) block_write_nb * SIZE_BLOCK < size) {
+				read_blocks(DB_STARTING_ADDRESS + data_block_nb, 1, block);
+			}
+			else {
+				memset(block, 0, SIZE_BLOCK);
+			}
+			memcpy(&(block[offset]), &(buf[written]), chunk);
+			write_blocks(DB_STARTING_ADDRESS + data_block_nb, 1, block);
+			written += chunk;
+			block_write_nb++;
+		}
+		/////////////////////////////////////////////////////////////
+		// Whole blocks: write the contiguous run straight from buf //
+		/////////////////////////////////////////////////////////////
+		else {
+			int nblocks = 1;
+			while (length - written >= (long long) (nblocks + 1) * SIZE_BLOCK &&
+				get_file_block(inode_nb, block_write_nb + nblocks, 0) == data_block_nb + nblocks) {
+				nblocks++;
+			}
+			write_blocks(DB_STARTING_ADDRESS + data_block_nb, nblocks, &(buf[written]));
+			written += (long long) nblocks * SIZE_BLOCK;
+			block_write_nb += nblocks;
+		}
 	}
+	free(block);
 
-	//////////////////////////////////////////////////////////////
-	// Scenario 1: Wrting to a file with room left in the block //
-	//////////////////////////////////////////////////////////////
-	if ((file_entry.write_ptr % SIZE_BLOCK) + length  <= SIZE_BLOCK) {
-
-		memcpy(&(block[file_entry.write_ptr%SIZE_BLOCK]), buf, length);
-		// update file size
-		update_file_size(inode_nb, file_entry.write_ptr, length);
-		// update write pointer
-		file_entry.write_ptr += length;
-		Open_Fd_Table[fileID] = file_entry;
-
-		write_blocks(DB_STARTING_ADDRESS + data_block_nb, 1, block);
-		free(block);
-   		return length;
+	// update file size
+	if (written > 0) {
+		update_file_size(inode_nb, file_entry.write_ptr, written);
 	}
-	////////////////////////////////////////////////////////////////////
-	// Scenario 2: Wrting to a file with not enough room in the block //
-	////////////////////////////////////////////////////////////////////
-	else {
-		int size_left_in_block = SIZE_BLOCK - (file_entry.write_ptr % SIZE_BLOCK);
-
-		memcpy(&(block[file_entry.write_ptr%SIZE_BLOCK]), buf, size_left_in_block);
+	// update write pointer
+	file_entry.write_ptr += written;
+	Open_Fd_Table[fileID] = file_entry;
 
-		// update file size
-		update_file_size(inode_nb, file_entry.write_ptr, size_left_in_block);
-		// update write pointer
-		file_entry.write_ptr += size_left_in_block;
-		Open_Fd_Table[fileID] = file_entry;
-
-		write_blocks(DB_STARTING_ADDRESS + data_block_nb, 1, block);
-		free(block);
-		return size_left_in_block + ssfs_fwrite(fileID, &(buf[size_left_in_block]), length - size_left_in_block);
-	}
+	// Write back the metadata and the blocks this write dirtied in the cache
+	sync_operation();
+	return written;
 }
 
 //
 // Read the string into "buf" of size "length" from the file pointed by the file's ID
 //
-int ssfs_fread(int fileID, char *buf, int length){
+long long ssfs_fread(int fileID, char *buf, long long length){
 
 	if (length <= 0) {
 		return 0;
 	}
 
-	if (fileID < 0 || fileID > MAX_FILES) {
+	if (fileID < 0 || fileID >= fd_table_size) {
 		printf("Error: Incorrect fileID\n");
 		return 0;
 	}
 
 	Fd_entry file_entry = Open_Fd_Table[fileID];
-	int block_nb = -1;
 	int inode_nb = file_entry.inode_nb;
-	int block_read_nb = file_entry.read_ptr / SIZE_BLOCK;
-	char* block = (char*) malloc(SIZE_BLOCK);
-	// Need to use indirect pointer
-	if (block_read_nb > 13) {
-		block_read_nb = block_read_nb % 14;
-		// Get indirect pointer i-node's number
-		int direct_ptr_nb = inode_nb/(SIZE_BLOCK/sizeof(Node));
-		int temp_block_nb = (*root_jnode).direct_ptr[direct_ptr_nb];
-		int inode_nb_in_block = inode_nb % (SIZE_BLOCK/sizeof(Node));	
-		if (temp_block_nb > -1) {
-			// Get i-node block
-			Node* inode_block = (Node*) malloc(SIZE_BLOCK);
-			read_blocks(DB_STARTING_ADDRESS + temp_block_nb, 1, inode_block);			
-			// Get i-node
-			Node inode = inode_block[inode_nb_in_block];
-			inode_nb = inode.indirectPtr;
-			free(inode_block);
-		}
-		else {
-			printf("Error: Negative Block number\n");
-			return 0;
-		}
-		block_nb = copy_data_block(inode_nb, block, block_read_nb);
-	}
-	else {
-		block_nb = copy_data_block(inode_nb, block, block_read_nb);
-	}
-
-	if (block_nb == -1) {
+	if (get_inode(inode_nb) == NULL) {
 		printf("Error: Error getting block in ssfs_fread\n");
-		free(block);
 		return 0;
 	}
 
-	int size = get_file_size(inode_nb);
+	long long size = get_file_size(inode_nb);
 	if (length + file_entry.read_ptr > size) {
 		printf("Error: Read length too big\n");
 		// Reduce the length, as you can't read above the size
-		length = size;
+		length = size > file_entry.read_ptr ? size - file_entry.read_ptr : 0;
+		if (length == 0) {
+			return 0;
+		}
 	}
 
-	///////////////////////////////////////////
-	// Scenario 1: Read from a single block  //
-	///////////////////////////////////////////
-	if ((file_entry.read_ptr%SIZE_BLOCK) + length < SIZE_BLOCK) {
-		memcpy(buf, &(block[file_entry.read_ptr%SIZE_BLOCK]), length%SIZE_BLOCK);
-		// update read pointer
-		file_entry.read_ptr += length;
-		Open_Fd_Table[fileID] = file_entry;
-
-		free(block);
-		return length;
+	int head_offset = file_entry.read_ptr % SIZE_BLOCK;
+	int block_read_nb = file_entry.read_ptr / SIZE_BLOCK;
+	int last_block_read_nb = (file_entry.read_ptr + length - 1) / SIZE_BLOCK;
+	int tail_length = (file_entry.read_ptr + length) % SIZE_BLOCK;
+
+	// Only the partial head and tail blocks go through a block buffer, whole blocks are read straight into buf
+	int head_partial = (head_offset != 0 || (block_read_nb == last_block_read_nb && tail_length != 0));
+	int tail_partial = (last_block_read_nb > block_read_nb && tail_length != 0);
+	char* head_block = head_partial ? (char*) malloc(SIZE_BLOCK) : NULL;
+	char* tail_block = tail_partial ? (char*) malloc(SIZE_BLOCK) : NULL;
+
+	///////////////////////////////////////////////////////////////
+	// Resolve the whole range to runs of contiguous data blocks //
+	// once, then read each run with one block request, all of   //
+	// them in flight at the same time                           //
+	///////////////////////////////////////////////////////////////
+	int first_whole = block_read_nb + head_partial;
+	int last_whole = last_block_read_nb - tail_partial;
+	struct blk_iovec* runs = (struct blk_iovec*) malloc((last_block_read_nb - block_read_nb + 1) * sizeof(struct blk_iovec));
+	int nb_runs = 0;
+	int res = 0;
+	if (head_partial) {
+		res = file_block_runs(inode_nb, block_read_nb, 1, head_block, runs);
+		nb_runs += res;
+	}
+	if (res != -1 && first_whole <= last_whole) {
+		res = file_block_runs(inode_nb, first_whole, last_whole - first_whole + 1,
+			&(buf[(long long) first_whole*SIZE_BLOCK - file_entry.read_ptr]), &(runs[nb_runs]));
+		nb_runs += res;
+	}
+	if (res != -1 && tail_partial) {
+		res = file_block_runs(inode_nb, last_block_read_nb, 1, tail_block, &(runs[nb_runs]));
+		nb_runs += res;
+	}
+	if (res == -1 || read_runs(runs, nb_runs) == -1) {
+		printf("Error: Error getting block in ssfs_fread\n");
+		free(head_block);
+		free(tail_block);
+		free(runs);
+		return 0;
 	}
-	///////////////////////////////////////////
-	// Scenario 2: Read from multiple blocks //
-	///////////////////////////////////////////
-	else {
-		int size_left_in_block = SIZE_BLOCK - (file_entry.read_ptr%SIZE_BLOCK);
-		memcpy(buf, &(block[file_entry.read_ptr%SIZE_BLOCK]), size_left_in_block);
 
-		// update read pointer
-		file_entry.read_ptr += size_left_in_block;
-		Open_Fd_Table[fileID] = file_entry;
-
-		free(block);
-		return size_left_in_block + ssfs_fread(fileID, &(buf[size_left_in_block]), length - size_left_in_block);		
+	// Copy the bytes wanted out of the partial blocks
+	if (head_partial) {
+		int head_length = SIZE_BLOCK - head_offset;
+		if (head_length > length) {
+			head_length = length;
+		}
+		memcpy(buf, &(head_block[head_offset]), head_length);
 	}
-}
-
-/*
-/ Release i-node entry and the data blocks used. This function is USED ONLY FOR INDIRECT POINTERS
-*/
-void ssfs_remove_inode(int nb) {
-
-	int inode_nb = nb;
-	int direct_ptr[14];
-
-	//////////////////////////
-	// Release i-node entry //
-    //////////////////////////
-	int direct_ptr_nb = inode_nb/(SIZE_BLOCK/sizeof(Node));
-	int block_nb = (*root_jnode).direct_ptr[direct_ptr_nb];
-	int node_nb_in_block = inode_nb % (SIZE_BLOCK/sizeof(Node));
-	if (root_jnode == NULL) {
-		getRootJNode();
+	if (tail_partial) {
+		memcpy(&(buf[length - tail_length]), tail_block, tail_length);
 	}
-	// Get i-node block
-	Node* inode_block = (Node*) malloc(SIZE_BLOCK);
-	read_blocks(DB_STARTING_ADDRESS + block_nb, 1, inode_block);
 
-	// Reset specific i-node
-	inode_block[node_nb_in_block].size = -1;
-	// Check if there's an indirect pointer, if there is, need to delete everything related to it as well
-	if (inode_block[node_nb_in_block].indirectPtr != -1) {
-		ssfs_remove_inode(inode_block[node_nb_in_block].indirectPtr);
-		modify_fbm(inode_block[node_nb_in_block].indirectPtr,0);
-	}	
-	inode_block[node_nb_in_block].indirectPtr = -1;
-	for (int i=0; i<14; i++) {
-		direct_ptr[i] = inode_block[node_nb_in_block].direct_ptr[i];
-		inode_block[node_nb_in_block].direct_ptr[i] = -1;
-	}
-	// update in disk
-	write_blocks(DB_STARTING_ADDRESS + block_nb, 1, inode_block);
-	free(inode_block);
+	// update read pointer
+	file_entry.read_ptr += length;
+	Open_Fd_Table[fileID] = file_entry;
 
-    //////////////////////////////////////////////
-    // Release the data blocks used by the file //
-    //////////////////////////////////////////////
-	for (int i=0; i<14; i++) {
-		if (direct_ptr[i] != -1) {
-			modify_fbm(direct_ptr[i], 0);
-		}
-	}
+	free(head_block);
+	free(tail_block);
+	free(runs);
+	return length;
 }
 
 /*
@@ -1214,71 +2177,52 @@ void ssfs_remove_inode(int nb) {
 int ssfs_remove(char *file){
 
 	int inode_nb = -1;
-	int direct_ptr[14];
 
 	//////////////////////////////////////
 	// Remove file from Open File Table //
 	//////////////////////////////////////
-	int fd_index = ssfs_fopen(file);
-	if (fd_index != -1) {
-		Open_Fd_Table[fd_index].inode_nb = -1;
-		Open_Fd_Table[fd_index].write_ptr = -1;
-		Open_Fd_Table[fd_index].read_ptr = -1;	
+	int dir_slot = find_directory_entry(file);
+	if (dir_slot == -1) {
+		printf("Error: No file named %s\n", file);
+		return -1;
+	}
+	inode_nb = root_dir_cache[dir_slot].inode_nb;
+	if (get_inode(inode_nb) != NULL && inode_fd_map[inode_nb] != -1) {
+		release_fd(inode_fd_map[inode_nb]);
 	}
 
 	//////////////////////////////////////
 	// Remove file from directory entry //
 	//////////////////////////////////////
-	for (int i=0; i<MAX_FILES; i++) {
-		if (strcmp(file, root_dir_cache[i].filename) == 0) {
-			inode_nb = root_dir_cache[i].inode_nb;
-			// Reset values
-			strcpy(root_dir_cache[i].filename, "");
-			root_dir_cache[i].inode_nb = -1;
-			// Update directory in disk
-			update_directory_disk();
-			break;
-		}
-	}
+	unindex_directory_entry(dir_slot);
+	// Reset values
+	strcpy(root_dir_cache[dir_slot].filename, "");
+	root_dir_cache[dir_slot].inode_nb = -1;
+	mark_directory_dirty(dir_slot);
+	dir_free_slots[dir_free_count++] = dir_slot;
+	// Update directory in disk
+	update_directory_disk();
 
 	//////////////////////////
 	// Release i-node entry //
     //////////////////////////
-	int direct_ptr_nb = inode_nb/(SIZE_BLOCK/sizeof(Node));
-	int block_nb = (*root_jnode).direct_ptr[direct_ptr_nb];
-	int node_nb_in_block = inode_nb % (SIZE_BLOCK/sizeof(Node));
-	if (root_jnode == NULL) {
-		getRootJNode();
+	// Get i-node
+	Node* inode = get_inode(inode_nb);
+	if (inode == NULL) {
+		printf("Error: Negative Block number\n");
+		return -1;
 	}
-	// Get i-node block
-	Node* inode_block = (Node*) malloc(SIZE_BLOCK);
-	read_blocks(DB_STARTING_ADDRESS + block_nb, 1, inode_block);
 
 	// Reset specific i-node
-	inode_block[node_nb_in_block].size = -1;
-
-	// Check if there's an indirect pointer, if there is, need to delete everything related to it as well
-	if (inode_block[node_nb_in_block].indirectPtr != -1) {
-		ssfs_remove_inode(inode_block[node_nb_in_block].indirectPtr);
-		modify_fbm(inode_block[node_nb_in_block].indirectPtr,0);
-	}
-
-	inode_block[node_nb_in_block].indirectPtr = -1;
-	for (int i=0; i<14; i++) {
-		direct_ptr[i] = inode_block[node_nb_in_block].direct_ptr[i];
-		inode_block[node_nb_in_block].direct_ptr[i] = -1;
-	}
-	// update in disk
-	write_blocks(DB_STARTING_ADDRESS + block_nb, 1, inode_block);
-	free(inode_block);
+	(*inode).size = -1;
 
     //////////////////////////////////////////////
     // Release the data blocks used by the file //
     //////////////////////////////////////////////
-	for (int i=0; i<14; i++) {
-		if (direct_ptr[i] != -1) {
-			modify_fbm(direct_ptr[i], 0);
-		}
-	}
+	// update in cache, written back with the rest of the operation
+	release_file_blocks(inode_nb);
+	release_inode(inode_nb);
+
+	sync_operation();
     return 0;
 }
\ No newline at end of file
@@ -1,12 +1,15 @@
 //Functions you should implement. 
 //Return -1 for error besides mkssfs
 void mkssfs(int fresh);
+//Create a file system with the given block size, number of blocks and number of i-nodes. Return -1 if they can't hold one
+int mkssfs_ex(int block_size, int nb_blocks, int nb_inodes);
 int ssfs_fopen(char *name);
 int ssfs_fclose(int fileID);
-int ssfs_frseek(int fileID, int loc);
-int ssfs_fwseek(int fileID, int loc);
-int ssfs_fwrite(int fileID, char *buf, int length);
-int ssfs_fread(int fileID, char *buf, int length);
+//Locations, lengths and the bytes written/read are 64-bit so files can grow past 2 GiB
+int ssfs_frseek(int fileID, long long loc);
+int ssfs_fwseek(int fileID, long long loc);
+long long ssfs_fwrite(int fileID, char *buf, long long length);
+long long ssfs_fread(int fileID, char *buf, long long length);
 int ssfs_remove(char *file);
 int ssfs_commit();
 int ssfs_restore(int cnum);
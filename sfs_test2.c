@@ -21,6 +21,16 @@ int difficult_test(){
   test_persistence(&err_no, 256);
   test_persistence(&err_no, 512);
   test_persistence(&err_no, 1024);
+  //Large enough to need the double indirect block
+  test_persistence(&err_no, 16384);
+  test_fbm_persistence(&err_no);
+  test_geometry(&err_no);
+  test_large_offsets(&err_no);
+  test_format_upgrade(&err_no);
+  test_async(&err_no);
+  test_striping(&err_no);
+  test_disk_stats(&err_no);
+  test_cache(&err_no);
   mkssfs(1);                     /* Initialize the file system. */
   //Attemping to crash the system with overflowing fopens
   //This function will remove all files after it's done.
@@ -154,6 +154,737 @@ int test_persistence(int *error, int write_length){
     return 0;
 }
 
+/*
+Runs child(arg) in a child process, which stands for a crash when it exits without
+unmounting. Returns the exit status of the child, 10 if it did not exit.
+*/
+static int run_child(int (*child)(void *), void *arg){
+    int pid;
+    int temp;
+
+    //Children must not inherit pending output
+    fflush(stdout);
+    pid = fork();
+    if(pid == 0)
+        exit(child(arg));
+    waitpid(pid, &temp, 0);
+    return WIFEXITED(temp) ? WEXITSTATUS(temp) : 10;
+}
+
+//Contents of the files written by the free block map persistence test
+struct fbm_data {
+    char *data;
+    char *other;
+};
+
+static int fbm_write_child(void *arg){
+    struct fbm_data *d = arg;
+    mkssfs(1);
+    int file_id = ssfs_fopen("fbm1.txt");
+    return ssfs_fwrite(file_id, d->data, FBM_TEST_BLOCKS * 1024) != FBM_TEST_BLOCKS * 1024;
+}
+
+static int fbm_reuse_child(void *arg){
+    struct fbm_data *d = arg;
+    char *read_buf = calloc(FBM_TEST_BLOCKS * 1024 + 1, sizeof(char));
+    mkssfs(0);
+    int file_id = ssfs_fopen("fbm2.txt");
+    int ret = ssfs_fwrite(file_id, d->other, FBM_TEST_BLOCKS * 1024) != FBM_TEST_BLOCKS * 1024;
+    file_id = ssfs_fopen("fbm1.txt");
+    ssfs_frseek(file_id, 0);
+    if(ssfs_fread(file_id, read_buf, FBM_TEST_BLOCKS * 1024) != FBM_TEST_BLOCKS * 1024 || strcmp(read_buf, d->data) != 0){
+        fprintf(stderr, "Error. Blocks of a written file were given to another file after a crash\n");
+        ret += 1;
+    }
+    ssfs_remove("fbm1.txt");
+    ssfs_remove("fbm2.txt");
+    free(read_buf);
+    return ret;
+}
+
+static int fbm_round_child(void *arg){
+    struct fbm_data *d = arg;
+    mkssfs(0);
+    int file_id = ssfs_fopen("fbm3.txt");
+    int ret = ssfs_fwrite(file_id, d->data, FBM_TEST_BLOCKS * 1024) != FBM_TEST_BLOCKS * 1024;
+    ssfs_remove("fbm3.txt");
+    return ret;
+}
+
+/*
+Tests when free block map changes reach the disk. Blocks allocated by a ssfs_fwrite that
+returned must be marked used on disk, so a mount after a crash never hands them to another
+file. Blocks released by a ssfs_remove that returned must be marked free on disk, so files
+can be created and removed across crashes forever without running out of blocks.
+*/
+int test_fbm_persistence(int *error){
+    struct fbm_data d;
+    int error_num = 0;
+
+    d.data = rand_text(FBM_TEST_BLOCKS * 1024);
+    d.other = rand_text(FBM_TEST_BLOCKS * 1024);
+    printf("Checking Free Block Map Persistence ... \n");
+    //Allocate, crash, then allocate again from a fresh mount
+    error_num += run_child(fbm_write_child, &d);
+    error_num += run_child(fbm_reuse_child, &d);
+    //Write more blocks in total than the disk holds, removing the file before each crash
+    for(int i = 0; i < FBM_TEST_ROUNDS && error_num == 0; i++){
+        if(run_child(fbm_round_child, &d) != 0){
+            fprintf(stderr, "Error. Removed blocks were not freed on disk, write failed after %d rounds\n", i);
+            error_num += 1;
+        }
+    }
+    free(d.data);
+    free(d.other);
+    *error += error_num;
+    printf("\n-------------------------------\nTest_num[%d]: Current Error Num: %d\n--------------------------------\n\n", test_num, *error);
+    test_num++;
+    return 0;
+}
+
+static int geometry_write_child(void *arg){
+    char name[MAX_FNAME_LENGTH + 1];
+    int ret = 0;
+    if(mkssfs_ex(GEOMETRY_BLOCK_SIZE, GEOMETRY_BLOCKS, GEOMETRY_INODES) != 0)
+        return 1;
+    for(int i = 0; i < GEOMETRY_FILES; i++){
+        sprintf(name, "geo%d", i);
+        int file_id = ssfs_fopen(name);
+        if(file_id < 0 || ssfs_fwrite(file_id, name, strlen(name)) != strlen(name))
+            ret = 1;
+        ssfs_fclose(file_id);
+    }
+    int file_id = ssfs_fopen("geobig");
+    if(ssfs_fwrite(file_id, arg, GEOMETRY_BYTES) != GEOMETRY_BYTES)
+        ret += 1;
+    return ret;
+}
+
+static int geometry_read_child(void *arg){
+    char name[MAX_FNAME_LENGTH + 1];
+    char *read_buf = calloc(GEOMETRY_BYTES + 1, sizeof(char));
+    int ret = 0;
+    mkssfs(0);
+    for(int i = 0; i < GEOMETRY_FILES; i++){
+        sprintf(name, "geo%d", i);
+        memset(read_buf, 0, MAX_FNAME_LENGTH + 1);
+        int file_id = ssfs_fopen(name);
+        ssfs_frseek(file_id, 0);
+        if(ssfs_fread(file_id, read_buf, strlen(name)) != strlen(name) || strcmp(read_buf, name) != 0)
+            ret = 1;
+        ssfs_fclose(file_id);
+    }
+    int file_id = ssfs_fopen("geobig");
+    ssfs_frseek(file_id, 0);
+    if(ssfs_fread(file_id, read_buf, GEOMETRY_BYTES) != GEOMETRY_BYTES || strcmp(read_buf, arg) != 0)
+        ret += 1;
+    if(ret != 0)
+        fprintf(stderr, "Error. Files written to a disk with its own geometry did not survive a mount\n");
+    free(read_buf);
+    return ret;
+}
+
+/*
+Formats disks with a geometry of their own through mkssfs_ex. Geometries that can't hold
+a file system are refused. A disk with another block size, block count and i-node count
+holds as many files as it has i-nodes, and mkssfs(0) mounts it with that geometry.
+*/
+int test_geometry(int *error){
+    char *data = rand_text(GEOMETRY_BYTES);
+    int error_num = 0;
+
+    printf("Checking Disk Geometry ... \n");
+    //Block size not a power of 2, too few blocks, too many i-nodes
+    if(mkssfs_ex(1000, GEOMETRY_BLOCKS, GEOMETRY_INODES) != -1 ||
+       mkssfs_ex(GEOMETRY_BLOCK_SIZE, 4, GEOMETRY_INODES) != -1 ||
+       mkssfs_ex(GEOMETRY_BLOCK_SIZE, GEOMETRY_BLOCKS, 1000000) != -1){
+        fprintf(stderr, "Error. A geometry that can't hold a file system was accepted\n");
+        error_num += 1;
+    }
+    //Fill the formatted disk, then read it back from a fresh mount
+    error_num += run_child(geometry_write_child, data);
+    error_num += run_child(geometry_read_child, data);
+    free(data);
+    *error += error_num;
+    printf("\n-------------------------------\nTest_num[%d]: Current Error Num: %d\n--------------------------------\n\n", test_num, *error);
+    test_num++;
+    return 0;
+}
+
+/*
+Checks that locations and lengths past 32 bits reach the file system whole, instead of
+being cut down to a small number that fits an int.
+*/
+int test_large_offsets(int *error){
+    char read_buf[8] = {0};
+    char small_buf[6] = {0};
+    int error_num = 0;
+
+    printf("Checking 64-bit Offsets ... \n");
+    mkssfs(1);
+    int file_id = ssfs_fopen("off64.txt");
+    ssfs_fwrite(file_id, "01234", 5);
+    //4 GiB + 3 is 3 when cut to 32 bits, which is within the file
+    if(ssfs_frseek(file_id, (1LL << 32) + 3) != -1 || ssfs_fwseek(file_id, (1LL << 32) + 3) != -1){
+        fprintf(stderr, "Error. Seek past the end of the file was accepted\n");
+        error_num += 1;
+    }
+    ssfs_frseek(file_id, 0);
+    if(ssfs_fread(file_id, read_buf, sizeof read_buf - 1) != 5 || strcmp(read_buf, "01234") != 0){
+        fprintf(stderr, "Error. Read past the end of the file did not stop there\n");
+        error_num += 1;
+    }
+    //The file fits small_buf, so any length ends the read at the end of the file.
+    //4 GiB + 1 is 1 when cut to 32 bits, the read must still return the whole file
+    int small_id = ssfs_fopen("small64.txt");
+    ssfs_fwrite(small_id, "56789", 5);
+    ssfs_frseek(small_id, 0);
+    if(ssfs_fread(small_id, small_buf, (1LL << 32) + 1) != 5 || strcmp(small_buf, "56789") != 0){
+        fprintf(stderr, "Error. Read of a 64-bit length did not stop at the end of the file\n");
+        error_num += 1;
+    }
+    ssfs_remove("off64.txt");
+    ssfs_remove("small64.txt");
+    *error += error_num;
+    printf("\n-------------------------------\nTest_num[%d]: Current Error Num: %d\n--------------------------------\n\n", test_num, *error);
+    test_num++;
+    return 0;
+}
+
+//Image of the file system, see sfs_api.c
+extern char *DISK_NAME;
+
+/*
+Writes the image of a format version 5 disk holding the given files, as that version laid
+them out: default geometry, with a byte per data block in the FBM. I-nodes and the root
+j-node are 16 ints: a size, 14 direct pointers, then the number of a chained i-node whose
+direct pointers hold the next 14 blocks of the file. The i-node file is one block, in data
+block 0, and the root directory takes the last 4 data blocks. File i has i-node i+1 and
+blocks in order from data block 1. One more i-node holds a block no file reaches, as
+version 5 lost chained i-nodes. Returns 0, -1 if the image can't be written.
+*/
+static int write_v5_image(int *lengths, char **data){
+    struct {char filename[10]; int inode_nb;} dir[4][V5_BLOCK_SIZE / 16];
+    int sb[V5_BLOCK_SIZE / sizeof(int)];
+    int inodes[V5_BLOCK_SIZE / sizeof(int)];
+    char fbm[V5_BLOCK_SIZE] = {0};
+    char block[V5_BLOCK_SIZE];
+    int next_inode = UPGRADE_FILES + 1;
+    int next_block = 1;
+
+    if(init_fresh_disk(DISK_NAME, V5_BLOCK_SIZE, V5_DATA_BLOCKS + 3) == -1)
+        return -1;
+    memset(inodes, 0xFF, sizeof inodes);
+    memset(dir, 0, sizeof dir);
+    for(int i = 0; i < 4 * V5_BLOCK_SIZE / 16; i++)
+        dir[i / (V5_BLOCK_SIZE / 16)][i % (V5_BLOCK_SIZE / 16)].inode_nb = -1;
+    //Directory i-node
+    inodes[0] = 4 * V5_BLOCK_SIZE;
+    for(int k = 0; k < 4; k++){
+        inodes[1 + k] = V5_DATA_BLOCKS - 4 + k;
+        fbm[V5_DATA_BLOCKS - 4 + k] = 1;
+    }
+    fbm[0] = 1;
+    for(int i = 0; i < UPGRADE_FILES; i++){
+        int *node = &inodes[(i + 1) * 16];
+        int nblocks = (lengths[i] + V5_BLOCK_SIZE - 1) / V5_BLOCK_SIZE;
+        node[0] = lengths[i] < V5_DIRECT_PTRS * V5_BLOCK_SIZE ? lengths[i] : V5_DIRECT_PTRS * V5_BLOCK_SIZE;
+        //Past the direct blocks, the chained i-node is sized with the end of the file
+        if(nblocks > V5_DIRECT_PTRS){
+            node[15] = next_inode;
+            inodes[next_inode * 16] = lengths[i];
+            next_inode++;
+        }
+        for(int b = 0; b < nblocks; b++){
+            int size = lengths[i] - b * V5_BLOCK_SIZE < V5_BLOCK_SIZE ? lengths[i] - b * V5_BLOCK_SIZE : V5_BLOCK_SIZE;
+            memset(block, 0, sizeof block);
+            memcpy(block, data[i] + b * V5_BLOCK_SIZE, size);
+            write_blocks(1 + next_block, 1, block);
+            fbm[next_block] = 1;
+            if(b < V5_DIRECT_PTRS)
+                node[1 + b] = next_block;
+            else
+                inodes[node[15] * 16 + 1 + b - V5_DIRECT_PTRS] = next_block;
+            next_block++;
+        }
+        sprintf(dir[0][i].filename, "old%d", i);
+        dir[0][i].inode_nb = i + 1;
+    }
+    //Lost chained i-node
+    inodes[next_inode * 16] = 0;
+    inodes[next_inode * 16 + 1] = next_block;
+    fbm[next_block] = 1;
+    //The 4th directory block has room for 7 of the 199 files, the rest is marked unusable
+    for(int i = 7; i < V5_BLOCK_SIZE / 16; i++){
+        strcpy(dir[3][i].filename, "UNUSABLE");
+        dir[3][i].inode_nb = 100000;
+    }
+    //Magic, block size, file system size, i-nodes, root j-node, then the unused shadow roots
+    memset(sb, 0, sizeof sb);
+    memset(&sb[4], 0xFF, 15 * 16 * sizeof(int));
+    sb[0] = 0xACBD0005;
+    sb[1] = V5_BLOCK_SIZE;
+    sb[2] = V5_DATA_BLOCKS + 3;
+    sb[3] = 200;
+    sb[4] = V5_BLOCK_SIZE;
+    sb[5] = 0;
+    write_blocks(0, 1, sb);
+    write_blocks(1, 1, inodes);
+    for(int k = 0; k < 4; k++)
+        write_blocks(1 + V5_DATA_BLOCKS - 4 + k, 1, dir[k]);
+    write_blocks(1 + V5_DATA_BLOCKS, 1, fbm);
+    memset(block, 0, sizeof block);
+    write_blocks(2 + V5_DATA_BLOCKS, 1, block);
+    close_disk();
+    return 0;
+}
+
+//Files of the format upgrade test, each with a block more of text to append
+struct upgrade_case {
+    int lengths[UPGRADE_FILES];
+    char *data[UPGRADE_FILES];
+};
+
+static int upgrade_write_child(void *arg){
+    struct upgrade_case *c = arg;
+    return write_v5_image(c->lengths, c->data) != 0;
+}
+
+static int upgrade_read_child(void *arg){
+    struct upgrade_case *c = arg;
+    char name[MAX_FNAME_LENGTH + 1];
+    unsigned long long fbm[V5_BLOCK_SIZE / sizeof(unsigned long long)];
+    int ret = 0;
+    mkssfs(0);
+    for(int i = 0; i < UPGRADE_FILES; i++){
+        int length = c->lengths[i] + V5_BLOCK_SIZE;
+        char *read_buf = calloc(length + 1, sizeof(char));
+        sprintf(name, "old%d", i);
+        int file_id = ssfs_fopen(name);
+        ssfs_frseek(file_id, 0);
+        if(ssfs_fread(file_id, read_buf, c->lengths[i]) != c->lengths[i] || strncmp(read_buf, c->data[i], c->lengths[i]) != 0){
+            fprintf(stderr, "Error. File %s did not read back whole after the upgrade\n", name);
+            ret = 1;
+        }
+        //The rest of the text, a block more
+        ssfs_fwrite(file_id, c->data[i] + c->lengths[i], V5_BLOCK_SIZE);
+        ssfs_frseek(file_id, 0);
+        if(ssfs_fread(file_id, read_buf, length) != length || strcmp(read_buf, c->data[i]) != 0){
+            fprintf(stderr, "Error. File %s did not grow after the upgrade\n", name);
+            ret = 1;
+        }
+        ssfs_remove(name);
+        free(read_buf);
+    }
+    //With the files removed, only the i-node file and root directory blocks are left in use.
+    //The FBM is now a bit per data block, in the same block as before
+    read_blocks(1 + V5_DATA_BLOCKS, 1, fbm);
+    for(int b = 0; b < V5_DATA_BLOCKS; b++){
+        int used = b == 0 || b >= V5_DATA_BLOCKS - 4;
+        if((int) ((fbm[b / 64] >> (b % 64)) & 1) != used){
+            fprintf(stderr, "Error. Data block %d is %s after the upgraded files were removed\n", b, used ? "free" : "used");
+            ret = 1;
+            break;
+        }
+    }
+    return ret;
+}
+
+/*
+Mounts a disk of format version 5, which is converted in place. Each file must read back
+whole, then grow and read back again once converted, and every block the files and the
+lost i-node held must be free once the files are removed.
+*/
+int test_format_upgrade(int *error){
+    struct upgrade_case c;
+    int error_num = 0;
+
+    printf("Checking Format Upgrade ... \n");
+    c.lengths[0] = 100;
+    c.lengths[1] = 12 * V5_BLOCK_SIZE;
+    c.lengths[2] = V5_DIRECT_PTRS * V5_BLOCK_SIZE - 100;
+    c.lengths[3] = 20 * V5_BLOCK_SIZE + 5;
+    for(int i = 0; i < UPGRADE_FILES; i++)
+        c.data[i] = rand_text(c.lengths[i] + V5_BLOCK_SIZE);
+    error_num += run_child(upgrade_write_child, &c);
+    error_num += run_child(upgrade_read_child, &c);
+    for(int i = 0; i < UPGRADE_FILES; i++)
+        free(c.data[i]);
+    *error += error_num;
+    printf("\n-------------------------------\nTest_num[%d]: Current Error Num: %d\n--------------------------------\n\n", test_num, *error);
+    test_num++;
+    return 0;
+}
+
+/*
+Writes ASYNC_TEST_BLOCKS blocks with one asynchronous request each, more than the engine
+keeps in flight, then reads them back in requests of ASYNC_TEST_RUN blocks. arg names the
+engine, as DISK_EMU_ASYNC does.
+*/
+static int async_child(void *arg){
+    char *data = rand_text(ASYNC_TEST_BLOCKS * 1024);
+    char *read_buf = calloc(ASYNC_TEST_BLOCKS * 1024 + 1, sizeof(char));
+    struct blk_completion done[ASYNC_TEST_BLOCKS];
+    int seen[ASYNC_TEST_BLOCKS] = {0};
+    int ret = 0;
+    int n, got;
+
+    //A process picks its engine when it first submits. The disk has no cache, which
+    //would send every request to the thread pool
+    setenv("DISK_EMU_ASYNC", arg, 1);
+    disk_set_cache(0, DISK_CACHE_CLOCK);
+    if(init_fresh_disk(DISK_TEST_NAME, 1024, ASYNC_TEST_BLOCKS) == -1)
+        return 1;
+    for(int i = 0; i < ASYNC_TEST_BLOCKS; i++)
+        if(submit_write(i, 1, data + i * 1024, &seen[i]) != 0)
+            ret = 1;
+    for(n = 0; n < ASYNC_TEST_BLOCKS; n += got){
+        got = poll_completions(done, ASYNC_TEST_BLOCKS, 1);
+        if(got == 0)
+            break;
+        for(int i = 0; i < got; i++){
+            if(done[i].result != 1)
+                ret = 1;
+            (*(int *) done[i].user_data)++;
+        }
+    }
+    //Each request completes once, and nothing is left in flight
+    for(int i = 0; i < ASYNC_TEST_BLOCKS; i++)
+        if(seen[i] != 1)
+            ret = 1;
+    if(poll_completions(done, ASYNC_TEST_BLOCKS, 1) != 0)
+        ret = 1;
+
+    for(int i = 0; i < ASYNC_TEST_BLOCKS; i += ASYNC_TEST_RUN)
+        if(submit_read(i, ASYNC_TEST_RUN, read_buf + i * 1024, NULL) != 0)
+            ret = 1;
+    for(n = 0; n < ASYNC_TEST_BLOCKS / ASYNC_TEST_RUN; n += got){
+        got = poll_completions(done, ASYNC_TEST_BLOCKS, ASYNC_TEST_BLOCKS / ASYNC_TEST_RUN - n);
+        if(got == 0)
+            break;
+        for(int i = 0; i < got; i++)
+            if(done[i].result != ASYNC_TEST_RUN)
+                ret = 1;
+    }
+    if(n != ASYNC_TEST_BLOCKS / ASYNC_TEST_RUN || strcmp(read_buf, data) != 0)
+        ret = 1;
+    //Past the end of the disk
+    if(submit_read(ASYNC_TEST_BLOCKS, 1, read_buf, NULL) != -1)
+        ret = 1;
+    close_disk();
+    unlink(DISK_TEST_NAME);
+    if(ret != 0)
+        fprintf(stderr, "Error. Asynchronous requests on the %s engine were lost or corrupted\n", (char *) arg);
+    free(data);
+    free(read_buf);
+    return ret;
+}
+
+/*
+Runs block requests through the asynchronous engine of disk_emu, on io_uring where the
+kernel has it and on the thread pool. Every request must complete once with all its
+blocks, and the blocks written must read back.
+*/
+int test_async(int *error){
+    int error_num = 0;
+
+    printf("Checking Asynchronous Block I/O ... \n");
+    error_num += run_child(async_child, "uring");
+    error_num += run_child(async_child, "threads");
+    *error += error_num;
+    printf("\n-------------------------------\nTest_num[%d]: Current Error Num: %d\n--------------------------------\n\n", test_num, *error);
+    test_num++;
+    return 0;
+}
+
+/*
+Writes a striped disk across stripe unit and stripe boundaries, then reads it back through
+the disk and member by member, where each stripe unit must be in its own place.
+*/
+static int striping_child(void *arg){
+    char member_name[32];
+    char block[1024];
+    char *data = rand_text(STRIPE_TEST_BLOCKS * 1024);
+    char *read_buf = calloc(STRIPE_TEST_BLOCKS * 1024 + 1, sizeof(char));
+    int ret = 0;
+
+    disk_set_striping(STRIPE_TEST_MEMBERS, STRIPE_TEST_UNIT);
+    disk_set_cache(0, DISK_CACHE_CLOCK);
+    disk_t *disk = disk_open(DISK_TEST_NAME, 1024, STRIPE_TEST_BLOCKS, DISK_OPEN_FRESH);
+    if(disk == NULL)
+        return 1;
+    //From the middle of the first stripe unit to the middle of the last one, then the
+    //first and last blocks in a vector of their own
+    struct blk_iovec ends[2] = {
+        {0, 1, data},
+        {STRIPE_TEST_BLOCKS - 1, 1, data + (STRIPE_TEST_BLOCKS - 1) * 1024}
+    };
+    if(disk_write(disk, 1, STRIPE_TEST_BLOCKS - 2, data + 1024) != STRIPE_TEST_BLOCKS - 2 ||
+       disk_write_v(disk, ends, 2) != 2)
+        ret = 1;
+    if(disk_read(disk, 0, STRIPE_TEST_BLOCKS, read_buf) != STRIPE_TEST_BLOCKS || strcmp(read_buf, data) != 0)
+        ret = 1;
+    disk_close(disk);
+
+    //Stripe unit u is in member u % members, after the units of the stripes before it
+    for(int b = 0; b < STRIPE_TEST_BLOCKS; b++){
+        int unit = b / STRIPE_TEST_UNIT;
+        sprintf(member_name, "%s.%d", DISK_TEST_NAME, unit % STRIPE_TEST_MEMBERS);
+        FILE *member = fopen(member_name, "rb");
+        if(member == NULL){
+            ret = 1;
+            continue;
+        }
+        fseek(member, ((long) (unit / STRIPE_TEST_MEMBERS) * STRIPE_TEST_UNIT + b % STRIPE_TEST_UNIT) * 1024, SEEK_SET);
+        if(fread(block, 1, 1024, member) != 1024 || memcmp(block, data + b * 1024, 1024) != 0)
+            ret = 1;
+        fclose(member);
+    }
+    for(int i = 0; i < STRIPE_TEST_MEMBERS; i++){
+        sprintf(member_name, "%s.%d", DISK_TEST_NAME, i);
+        unlink(member_name);
+    }
+    if(ret != 0)
+        fprintf(stderr, "Error. Blocks of a striped disk were lost or landed in the wrong member\n");
+    free(data);
+    free(read_buf);
+    return ret;
+}
+
+/*
+Stripes a disk over several image files. Transfers crossing stripe units must be split
+between the members and put back together in order.
+*/
+int test_striping(int *error){
+    int error_num = 0;
+
+    printf("Checking Disk Striping ... \n");
+    //In a child, the striping chosen here must not reach the other tests
+    error_num += run_child(striping_child, NULL);
+    *error += error_num;
+    printf("\n-------------------------------\nTest_num[%d]: Current Error Num: %d\n--------------------------------\n\n", test_num, *error);
+    test_num++;
+    return 0;
+}
+
+/*
+Checks the statistics of a disk after a known series of transfers, then the latency
+histogram under a device model slow enough to place its requests, and the error count
+under one where every transfer fails.
+*/
+static int stats_child(void *arg){
+    char buffer[4 * 1024];
+    struct disk_stats stats, zero;
+    struct disk_model model;
+    int ret = 0;
+
+    memset(buffer, 'x', sizeof buffer);
+    memset(&zero, 0, sizeof zero);
+    disk_set_cache(0, DISK_CACHE_CLOCK);
+    disk_set_model(NULL);
+    disk_t *disk = disk_open(DISK_TEST_NAME, 1024, STATS_TEST_BLOCKS, DISK_OPEN_FRESH);
+    if(disk == NULL)
+        return 1;
+    //Blocks 0-3, then a seek to 10, a seek back to 0-3, then 4 which follows on
+    disk_write(disk, 0, 4, buffer);
+    disk_write(disk, 10, 1, buffer);
+    disk_read(disk, 0, 4, buffer);
+    disk_read(disk, 4, 1, buffer);
+    disk_sync(disk);
+    disk_get_stats(disk, &stats);
+    if(stats.write.calls != 2 || stats.write.blocks != 5 || stats.write.errors != 0 ||
+       stats.read.calls != 2 || stats.read.blocks != 5 || stats.read.errors != 0 ||
+       stats.flush.calls != 1 || stats.seeks != 2 || stats.bytes_copied != 10 * 1024 ||
+       stats.cache_hits != 0 || stats.cache_misses != 0){
+        fprintf(stderr, "Error. Disk statistics do not count the transfers made\n");
+        ret += 1;
+    }
+    for(int i = 0; i < DISK_LAT_BUCKETS; i++){
+        stats.read.calls -= stats.read.latency_hist[i];
+        stats.write.calls -= stats.write.latency_hist[i];
+    }
+    if(stats.read.calls != 0 || stats.write.calls != 0){
+        fprintf(stderr, "Error. The latency histogram does not hold every call\n");
+        ret += 1;
+    }
+    disk_reset_stats(disk);
+    disk_get_stats(disk, &stats);
+    if(memcmp(&stats, &zero, sizeof stats) != 0){
+        fprintf(stderr, "Error. Disk statistics were not reset\n");
+        ret += 1;
+    }
+    disk_close(disk);
+
+    //The model of a disk is set when it is opened
+    memset(&model, 0, sizeof model);
+    model.latency_us = STATS_TEST_LATENCY_US;
+    model.queue_depth = 1;
+    disk_set_model(&model);
+    disk = disk_open(DISK_TEST_NAME, 1024, STATS_TEST_BLOCKS, 0);
+    disk_read(disk, 0, 1, buffer);
+    disk_get_stats(disk, &stats);
+    //Bucket i starts at 2^i us, the read can't be in one ending before the latency
+    unsigned long long early = 0;
+    for(int i = 0; (1 << (i + 1)) <= STATS_TEST_LATENCY_US; i++)
+        early += stats.read.latency_hist[i];
+    if(stats.read.calls != 1 || early != 0 || stats.read.total_ns < STATS_TEST_LATENCY_US * 1000ULL){
+        fprintf(stderr, "Error. The latency of a modeled read was not recorded\n");
+        ret += 1;
+    }
+    disk_close(disk);
+
+    model.latency_us = 0;
+    model.failure_p = 1;
+    model.max_retry = 0;
+    disk_set_model(&model);
+    disk = disk_open(DISK_TEST_NAME, 1024, STATS_TEST_BLOCKS, 0);
+    if(disk_read(disk, 0, 2, buffer) >= 0)
+        ret += 1;
+    disk_get_stats(disk, &stats);
+    if(stats.read.calls != 1 || stats.read.errors != 1 || stats.read.blocks != 0 || stats.bytes_copied != 0){
+        fprintf(stderr, "Error. A failed read was not counted as an error\n");
+        ret += 1;
+    }
+    disk_close(disk);
+    unlink(DISK_TEST_NAME);
+    return ret;
+}
+
+/*
+Tests the I/O statistics disk_get_stats returns.
+*/
+int test_disk_stats(int *error){
+    int error_num = 0;
+
+    printf("Checking Disk Statistics ... \n");
+    //In a child, the device models chosen here must not reach the other tests
+    error_num += run_child(stats_child, NULL);
+    *error += error_num;
+    printf("\n-------------------------------\nTest_num[%d]: Current Error Num: %d\n--------------------------------\n\n", test_num, *error);
+    test_num++;
+    return 0;
+}
+
+/*
+Tells whether block of the cache test image holds data, reading the file itself
+*/
+static int image_holds(int block, char *data){
+    char on_disk[1024];
+    FILE *image = fopen(DISK_TEST_NAME, "rb");
+    int same;
+
+    if(image == NULL)
+        return 0;
+    fseek(image, (long) block * 1024, SEEK_SET);
+    same = fread(on_disk, 1, 1024, image) == 1024 && memcmp(on_disk, data, 1024) == 0;
+    fclose(image);
+    return same;
+}
+
+/*
+Runs the buffer cache of the default disk through hits, write-back at disk_barrier, the
+eviction of arg's policy and a write-back that fails. The cache holds CACHE_TEST_BLOCKS
+blocks, and only small transfers go through it, so blocks are written one at a time.
+*/
+static int cache_child(void *arg){
+    int policy = *(int *) arg;
+    char *data = rand_text(CACHE_TEST_BLOCKS * 1024);
+    char read_buf[CACHE_TEST_BLOCKS * 1024];
+    struct disk_stats stats;
+    struct disk_model failing;
+    int ret = 0;
+
+    //The cache only exists on an image read with pread
+    unsetenv("DISK_EMU_BACKEND");
+    disk_set_striping(1, 16);
+    disk_set_model(NULL);
+    disk_set_cache(CACHE_TEST_BLOCKS, policy);
+    if(init_fresh_disk(DISK_TEST_NAME, 1024, CACHE_TEST_DISK_BLOCKS) == -1)
+        return 1;
+
+    //Writes stay in the cache and reads are served from it until the barrier
+    for(int b = 0; b < CACHE_TEST_BLOCKS; b++)
+        write_blocks(b, 1, data + b * 1024);
+    read_blocks(0, CACHE_TEST_BLOCKS, read_buf);
+    disk_get_stats(NULL, &stats);
+    if(stats.write.calls != 0 || image_holds(0, data) || stats.read.calls != 0 ||
+       stats.cache_hits != CACHE_TEST_BLOCKS || memcmp(read_buf, data, sizeof read_buf) != 0){
+        fprintf(stderr, "Error. Cached blocks were not kept in memory\n");
+        ret += 1;
+    }
+    disk_barrier();
+    disk_get_stats(NULL, &stats);
+    if(stats.cache_writebacks != CACHE_TEST_BLOCKS || stats.write.blocks != CACHE_TEST_BLOCKS ||
+       !image_holds(0, data) || !image_holds(CACHE_TEST_BLOCKS - 1, data + (CACHE_TEST_BLOCKS - 1) * 1024)){
+        fprintf(stderr, "Error. disk_barrier did not write the dirty cached blocks back\n");
+        ret += 1;
+    }
+
+    //After block 0 is used again, LRU evicts block 1 for a new block and CLOCK, whose
+    //sweep clears every reference bit, evicts block 0 under its hand
+    read_blocks(0, 1, read_buf);
+    read_blocks(CACHE_TEST_DISK_BLOCKS - 1, 1, read_buf);
+    int evicted = policy == DISK_CACHE_LRU ? 1 : 0;
+    disk_reset_stats(NULL);
+    read_blocks(1 - evicted, 1, read_buf);
+    disk_get_stats(NULL, &stats);
+    int kept_hit = stats.cache_hits == 1;
+    read_blocks(evicted, 1, read_buf);
+    disk_get_stats(NULL, &stats);
+    if(!kept_hit || stats.cache_misses != 1){
+        fprintf(stderr, "Error. The cache did not evict the block its policy chooses\n");
+        ret += 1;
+    }
+
+    //Once the cache is full of dirty blocks, new blocks need a write-back. When it fails,
+    //the write reports it and the blocks stay cached until a write-back succeeds
+    for(int b = 0; b < CACHE_TEST_BLOCKS; b++)
+        write_blocks(CACHE_TEST_BLOCKS + b, 1, data + b * 1024);
+    memset(&failing, 0, sizeof failing);
+    failing.failure_p = 1;
+    failing.max_retry = 0;
+    disk_set_model(&failing);
+    if(write_blocks(0, 1, data) >= 0 || disk_barrier() != -1){
+        fprintf(stderr, "Error. A failed write-back was not reported\n");
+        ret += 1;
+    }
+    disk_set_model(NULL);
+    disk_reset_stats(NULL);
+    disk_barrier();
+    int kept = 1;
+    for(int b = 0; b < CACHE_TEST_BLOCKS; b++)
+        if(!image_holds(CACHE_TEST_BLOCKS + b, data + b * 1024))
+            kept = 0;
+    //Written back exactly once
+    disk_barrier();
+    disk_get_stats(NULL, &stats);
+    if(!kept || stats.cache_writebacks != CACHE_TEST_BLOCKS){
+        fprintf(stderr, "Error. Dirty cached blocks were lost when their write-back failed\n");
+        ret += 1;
+    }
+    close_disk();
+    unlink(DISK_TEST_NAME);
+    free(data);
+    return ret;
+}
+
+/*
+Tests the buffer cache of disk_emu under both eviction policies.
+*/
+int test_cache(int *error){
+    int policies[2] = {DISK_CACHE_LRU, DISK_CACHE_CLOCK};
+    int error_num = 0;
+
+    printf("Checking Buffer Cache ... \n");
+    //In a child, the cache and device models chosen here must not reach the other tests
+    for(int i = 0; i < 2; i++)
+        error_num += run_child(cache_child, &policies[i]);
+    *error += error_num;
+    printf("\n-------------------------------\nTest_num[%d]: Current Error Num: %d\n--------------------------------\n\n", test_num, *error);
+    test_num++;
+    return 0;
+}
+
 /*
 Plays around with frseek and fwseek. Will shift the read and write pointer back by offset at the end if nothing fails. 
 If offset is greater than write pointer, write pointer is set to zero. 
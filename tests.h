@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include "sfs_api.h"
+#include "disk_emu.h"
 
 /* The maximum file name length. We assume that filenames can contain
  * upper-case letters and periods ('.') characters. Feel free to
@@ -29,6 +30,45 @@
 #define MAX_WRITE_BYTE 2025
 
 
+//Blocks written per file and files written by the free block map persistence test.
+//Together they write more blocks than the disk has.
+#define FBM_TEST_BLOCKS 13
+#define FBM_TEST_ROUNDS 100
+
+//Geometry of the disk formatted by the geometry test, and the files it writes there.
+//More files than the default disk has i-nodes, and one file that needs its indirect block.
+#define GEOMETRY_BLOCK_SIZE 4096
+#define GEOMETRY_BLOCKS     2048
+#define GEOMETRY_INODES     300
+#define GEOMETRY_FILES      250
+#define GEOMETRY_BYTES      (64 * GEOMETRY_BLOCK_SIZE)
+
+//Files on the format version 5 disk of the upgrade test: a partial block, all the direct
+//blocks, most of the 14 version 5 direct blocks, and blocks in a chained i-node.
+#define UPGRADE_FILES 4
+//Geometry of format version 5 disks, and their direct pointers per i-node
+#define V5_BLOCK_SIZE  1024
+#define V5_DATA_BLOCKS 1024
+#define V5_DIRECT_PTRS 14
+
+//Image the disk emulator tests open, apart from the file system's
+#define DISK_TEST_NAME "disk_test_image"
+//Blocks the asynchronous I/O test writes one request each, more than the engine keeps in
+//flight, and the blocks per request it reads them back with
+#define ASYNC_TEST_BLOCKS 200
+#define ASYNC_TEST_RUN    8
+//Striped disk of the striping test: blocks, members and blocks per stripe unit. The last
+//stripe is not full
+#define STRIPE_TEST_BLOCKS  19
+#define STRIPE_TEST_MEMBERS 4
+#define STRIPE_TEST_UNIT    2
+//Blocks of the disk statistics test, and the latency of its slow device model in us
+#define STATS_TEST_BLOCKS     16
+#define STATS_TEST_LATENCY_US 3000
+//Blocks the cache test caches, out of a disk of CACHE_TEST_DISK_BLOCKS
+#define CACHE_TEST_BLOCKS      4
+#define CACHE_TEST_DISK_BLOCKS 64
+
 //Don't change these values
 #define ABS_CAP_FD        4092
 #define ABS_CAP_FILE_SIZE 2000000
@@ -64,6 +104,14 @@ int test_overflow_open(int *file_id, int *file_sizes, int *write_ptr, char **fil
 
 //Test persistence
 int test_persistence(int *error, int write_length);
+int test_fbm_persistence(int *error);
+int test_geometry(int *error);
+int test_large_offsets(int *error);
+int test_format_upgrade(int *error);
+int test_async(int *error);
+int test_striping(int *error);
+int test_disk_stats(int *error);
+int test_cache(int *error);
 
 //Help functionn
 int free_name_element(char **name_list, int num_file);